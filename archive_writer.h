@@ -0,0 +1,254 @@
+#pragma once
+#include "object.h"
+#include <ar.h>
+#include <inttypes.h>
+
+// Static archive with one object per member: global header, symbol index,
+// names and members, so linkers only pull members whose symbols are
+// referenced. Member data is 8-byte aligned, objects are written in place
+// like standalone ones. ELF targets get the System V index ("/", "/SYM64/"
+// past 4G) and long names in "//", Mach-O the BSD index ("__.SYMDEF",
+// "__.SYMDEF_64") with names stored ahead of member data ("#1/<length>").
+// Dates, owners and modes are fixed, so archives are reproducible.
+
+#define ARCHIVE_HEADER_SIZE sizeof(struct ar_hdr)
+
+typedef struct {
+    sds name;       // file name of the member, e.g. "hello_txt.o"
+    Object *object; // laid out
+
+    // set by layout
+    uint64_t header_offset;
+    uint64_t data_offset; // where the object starts
+} ArchiveMember;
+
+typedef struct {
+    Target target;
+    ArchiveMember *members;
+    uint32_t members_count;
+
+    // set by layout
+    bool wide; // 64-bit index
+    uint64_t index_data_offset;
+    uint64_t index_size;
+    uint64_t names_offset; // System V only
+    uint64_t names_size;
+    uint64_t file_size;
+} Archive;
+
+bool archive_bsd(Archive *archive) {
+    return archive->target == TARGET_MACHO_ARM64;
+}
+
+const char *archive_symbol_prefix(Archive *archive) {
+    return archive_bsd(archive) ? "_" : "";
+}
+
+const char *archive_index_name(Archive *archive) {
+    if (archive_bsd(archive)) {
+        return archive->wide ? "__.SYMDEF_64" : "__.SYMDEF";
+    }
+    return archive->wide ? "/SYM64/" : "/";
+}
+
+// Data of a member with header at header_offset. BSD names go first, padded
+// with zeros so the data is 8-byte aligned.
+uint64_t archive_data_offset(Archive *archive, uint64_t header_offset,
+                             const char *name) {
+    uint64_t offset = header_offset + ARCHIVE_HEADER_SIZE;
+    if (archive_bsd(archive)) {
+        offset = ceil_to_alignment(offset + strlen(name) + 1, 8);
+    }
+    return offset;
+}
+
+// Header after member data ending at data_end. Headers are 2-byte aligned,
+// System V ones also 4 past a multiple of 8, so data right after them is
+// 8-byte aligned. Padding is part of the member.
+uint64_t archive_next_header(Archive *archive, uint64_t data_end) {
+    if (archive_bsd(archive)) {
+        return ceil_to_alignment(data_end, 2);
+    }
+    return ceil_to_alignment(data_end + 4, 8) - 4;
+}
+
+// Places index, names and members, returns the size of the archive.
+uint64_t layout_archive(Archive *archive) {
+    const char *prefix = archive_symbol_prefix(archive);
+    uint64_t symbols_count = 0;
+    uint64_t symbol_names_size = 0;
+    archive->names_size = 0;
+    for (uint32_t i = 0; i < archive->members_count; i++) {
+        Object *object = archive->members[i].object;
+        symbols_count += object->symbols_count;
+        for (uint32_t j = 0; j < object->symbols_count; j++) {
+            symbol_names_size += strlen(prefix) +
+                                 sdslen(object->symbols[j].name) + 1;
+        }
+        archive->names_size += sdslen(archive->members[i].name) + 2; // "/\n"
+    }
+
+    // member offsets in the index are 32-bit unless some don't fit
+    for (int wide = 0; wide < 2; wide++) {
+        archive->wide = wide;
+        const uint64_t word = wide ? sizeof(uint64_t) : sizeof(uint32_t);
+        archive->index_size =
+            archive_bsd(archive)
+                // ranlib entries (name, member) and names, sizes ahead
+                ? word + symbols_count * 2 * word + word +
+                      ceil_to_alignment(symbol_names_size, word)
+                // count, member of every symbol and names
+                : word + symbols_count * word + symbol_names_size;
+        archive->index_data_offset =
+            archive_data_offset(archive, SARMAG, archive_index_name(archive));
+        uint64_t cur = archive_next_header(
+            archive, archive->index_data_offset + archive->index_size);
+        if (!archive_bsd(archive)) {
+            archive->names_offset = cur;
+            cur = archive_next_header(archive, cur + ARCHIVE_HEADER_SIZE +
+                                                   archive->names_size);
+        }
+        for (uint32_t i = 0; i < archive->members_count; i++) {
+            ArchiveMember *member = &archive->members[i];
+            member->header_offset = cur;
+            member->data_offset =
+                archive_data_offset(archive, cur, member->name);
+            cur = archive_next_header(
+                archive, member->data_offset + member->object->file_size);
+        }
+        archive->file_size = cur;
+        if (cur <= UINT32_MAX) {
+            break;
+        }
+    }
+    return archive->file_size;
+}
+
+void write_archive_header(Archive *archive, Output *out, uint64_t offset,
+                          const char *name, uint64_t end) {
+    char header[ARCHIVE_HEADER_SIZE + 1];
+    char bsd_name[sizeof(((struct ar_hdr *)0)->ar_name) + 1];
+    if (archive_bsd(archive)) {
+        const uint64_t name_size =
+            archive_data_offset(archive, offset, name) - offset -
+            ARCHIVE_HEADER_SIZE;
+        snprintf(bsd_name, sizeof(bsd_name), "#1/%" PRIu64, name_size);
+        name = bsd_name;
+    }
+    snprintf(header, sizeof(header), "%-16s%-12s%-6s%-6s%-8s%-10" PRIu64 "%s",
+             name, "0", "0", "0", "644", end - offset - ARCHIVE_HEADER_SIZE,
+             ARFMAG);
+    output_write(out, offset, header, ARCHIVE_HEADER_SIZE);
+}
+
+void archive_put_word(uint8_t **p, uint64_t value, bool wide,
+                      bool big_endian) {
+    const int size = wide ? 8 : 4;
+    for (int i = 0; i < size; i++) {
+        const int shift = big_endian ? (size - 1 - i) * 8 : i * 8;
+        *(*p)++ = value >> shift;
+    }
+}
+
+// BSD names follow headers, padding after them reads as zeros.
+void write_archive_bsd_name(Output *out, uint64_t header_offset,
+                            const char *name) {
+    output_write(out, header_offset + ARCHIVE_HEADER_SIZE, name,
+                 strlen(name));
+}
+
+// Writes the global header, index, names and member headers, objects are
+// written by callers at data_offset of their members.
+void write_archive(Archive *archive, Output *out) {
+    const bool bsd = archive_bsd(archive);
+    const bool wide = archive->wide;
+    const char *prefix = archive_symbol_prefix(archive);
+    output_write(out, 0, ARMAG, SARMAG);
+
+    const uint64_t first_member_header =
+        archive->members_count > 0 ? archive->members[0].header_offset
+                                   : archive->file_size;
+    const uint64_t index_end = bsd ? first_member_header
+                                   : archive->names_offset;
+    write_archive_header(archive, out, SARMAG, archive_index_name(archive),
+                         index_end);
+    if (bsd) {
+        write_archive_bsd_name(out, SARMAG, archive_index_name(archive));
+    }
+
+    uint64_t symbols_count = 0;
+    for (uint32_t i = 0; i < archive->members_count; i++) {
+        symbols_count += archive->members[i].object->symbols_count;
+    }
+    const uint64_t word = wide ? sizeof(uint64_t) : sizeof(uint32_t);
+    uint8_t *index = calloc(archive->index_size ? archive->index_size : 1, 1);
+    uint8_t *entries = index;
+    // BSD names follow the ranlib entries, System V ones the offsets
+    const uint64_t names_start =
+        bsd ? word + symbols_count * 2 * word + word
+            : word + symbols_count * word;
+    uint8_t *names = index + names_start;
+    if (bsd) {
+        archive_put_word(&entries, symbols_count * 2 * word, wide, false);
+    } else {
+        archive_put_word(&entries, symbols_count, wide, true);
+    }
+    for (uint32_t i = 0; i < archive->members_count; i++) {
+        ArchiveMember *member = &archive->members[i];
+        Object *object = member->object;
+        for (uint32_t j = 0; j < object->symbols_count; j++) {
+            if (bsd) {
+                archive_put_word(&entries, names - index - names_start, wide,
+                                 false);
+            }
+            archive_put_word(&entries, member->header_offset, wide, !bsd);
+            names += sprintf((char *)names, "%s%s", prefix,
+                             object->symbols[j].name) +
+                     1;
+        }
+    }
+    if (bsd) {
+        archive_put_word(&entries, archive->index_size - names_start, wide,
+                         false);
+    }
+    output_write(out, archive->index_data_offset, index, archive->index_size);
+    free(index);
+
+    if (!bsd) {
+        // members are named "/<offset of the name here>"
+        const uint64_t names_end = archive->members_count > 0
+                                       ? archive->members[0].header_offset
+                                       : archive->file_size;
+        write_archive_header(archive, out, archive->names_offset, "//",
+                             names_end);
+        const uint64_t table_size =
+            names_end - archive->names_offset - ARCHIVE_HEADER_SIZE;
+        char *table = malloc(table_size + 1); // sprintf adds a zero
+        memset(table, '\n', table_size);
+        uint64_t pos = 0;
+        for (uint32_t i = 0; i < archive->members_count; i++) {
+            ArchiveMember *member = &archive->members[i];
+            char name[24];
+            snprintf(name, sizeof(name), "/%" PRIu64, pos);
+            pos += sprintf(table + pos, "%s/\n", member->name);
+            const uint64_t end = i + 1 < archive->members_count
+                                     ? archive->members[i + 1].header_offset
+                                     : archive->file_size;
+            write_archive_header(archive, out, member->header_offset, name,
+                                 end);
+        }
+        output_write(out, archive->names_offset + ARCHIVE_HEADER_SIZE, table,
+                     table_size);
+        free(table);
+        return;
+    }
+    for (uint32_t i = 0; i < archive->members_count; i++) {
+        ArchiveMember *member = &archive->members[i];
+        const uint64_t end = i + 1 < archive->members_count
+                                 ? archive->members[i + 1].header_offset
+                                 : archive->file_size;
+        write_archive_header(archive, out, member->header_offset,
+                             member->name, end);
+        write_archive_bsd_name(out, member->header_offset, member->name);
+    }
+}
@@ -0,0 +1,106 @@
+#pragma once
+#include "sds.h"
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bump allocator for data that lives as long as the run (asset records,
+// paths, symbol and section names) or as long as one step: allocations are
+// carved from big blocks and released all at once by arena_free(), so
+// there's no per-object malloc or free. Not thread safe, allocate on the
+// main thread. Strings made by arena_sds() are regular sds for reading, but
+// must not be grown or freed with sds functions, sdsdup() them first.
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    uint64_t size;
+    uint64_t used;
+    uint8_t data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *block; // the one allocations come from, older ones after it
+} Arena;
+
+void *arena_alloc(Arena *arena, uint64_t size, uint64_t align) {
+    ArenaBlock *block = arena->block;
+    if (block) {
+        const uintptr_t start = (uintptr_t)(block->data + block->used);
+        const uint64_t padding = (align - start % align) % align;
+        if (block->used + padding + size <= block->size) {
+            block->used += padding + size;
+            return block->data + block->used - size;
+        }
+    }
+    // allocations bigger than a block get one of their own
+    const uint64_t block_size =
+        size + align > ARENA_BLOCK_SIZE ? size + align : ARENA_BLOCK_SIZE;
+    block = malloc(sizeof(ArenaBlock) + block_size);
+    if (!block) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    *block = (ArenaBlock){.next = arena->block, .size = block_size};
+    arena->block = block;
+    return arena_alloc(arena, size, align);
+}
+
+// sds of len bytes, zero terminated, with the smallest header that fits.
+// Contents are left to the caller.
+sds arena_sdsalloc(Arena *arena, uint64_t len) {
+    char *s;
+    if (len < 1ULL << 8) {
+        struct sdshdr8 *sh = arena_alloc(arena, sizeof(*sh) + len + 1, 1);
+        *sh = (struct sdshdr8){.len = len, .alloc = len, .flags = SDS_TYPE_8};
+        s = sh->buf;
+    } else if (len < 1ULL << 16) {
+        struct sdshdr16 *sh = arena_alloc(arena, sizeof(*sh) + len + 1, 1);
+        *sh = (struct sdshdr16){
+            .len = len, .alloc = len, .flags = SDS_TYPE_16};
+        s = sh->buf;
+    } else if (len < 1ULL << 32) {
+        struct sdshdr32 *sh = arena_alloc(arena, sizeof(*sh) + len + 1, 1);
+        *sh = (struct sdshdr32){
+            .len = len, .alloc = len, .flags = SDS_TYPE_32};
+        s = sh->buf;
+    } else {
+        struct sdshdr64 *sh = arena_alloc(arena, sizeof(*sh) + len + 1, 1);
+        *sh = (struct sdshdr64){
+            .len = len, .alloc = len, .flags = SDS_TYPE_64};
+        s = sh->buf;
+    }
+    s[len] = 0;
+    return s;
+}
+
+// sds copy of len bytes at init.
+sds arena_sds(Arena *arena, const char *init, uint64_t len) {
+    sds s = arena_sdsalloc(arena, len);
+    memcpy(s, init, len);
+    return s;
+}
+
+// sds formatted like printf().
+sds arena_sdsprintf(Arena *arena, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    const int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    sds s = arena_sdsalloc(arena, len);
+    va_start(args, fmt);
+    vsnprintf(s, len + 1, fmt, args);
+    va_end(args);
+    return s;
+}
+
+void arena_free(Arena *arena) {
+    while (arena->block) {
+        ArenaBlock *next = arena->block->next;
+        free(arena->block);
+        arena->block = next;
+    }
+}
@@ -0,0 +1,120 @@
+# Compares crp with other ways to embed assets in an object: a C source from
+# xxd -i built by the C compiler, assembler .incbin and ld -r -b binary. For
+# every count, size and kind of generated assets it measures wall time, peak
+# RSS and output size of each and appends a JSON line per run to
+# build/bench/results.jsonl, so runs before and after a change can be
+# compared:
+#   COUNTS="1 1000 100000" SIZES="16 64K 1G" KINDS="text random" sh compare.sh
+# Combinations bigger than MAX_TOTAL in total are skipped, and xxd, which
+# turns every byte into six of source, above XXD_MAX_TOTAL.
+cd "$(dirname "$0")"
+COUNTS=${COUNTS:-1 1000 10000}
+SIZES=${SIZES:-16 4K 1M}
+KINDS=${KINDS:-text random}
+MAX_TOTAL=${MAX_TOTAL:-1G}
+XXD_MAX_TOTAL=${XXD_MAX_TOTAL:-16M}
+CC=${CC:-cc}
+
+bytes() {
+    case $1 in
+    *K) echo $((${1%K} << 10)) ;;
+    *M) echo $((${1%M} << 20)) ;;
+    *G) echo $((${1%G} << 30)) ;;
+    *) echo "$1" ;;
+    esac
+}
+
+mkdir -p build/bench
+$CC -O2 -w -pthread ../crp.c -o build/crp || exit 1
+$CC -O2 measure.c -o build/measure || exit 1
+results=$PWD/build/bench/results.jsonl
+rev=$(git rev-parse --short HEAD 2> /dev/null || echo unknown)
+cd build/bench
+
+printf 'x' > probe.bin
+has_ld_binary=false
+if ld -r -b binary -o probe.o probe.bin 2> /dev/null; then
+    has_ld_binary=true
+fi
+has_xxd=false
+if command -v xxd > /dev/null; then
+    has_xxd=true
+fi
+rm -f probe.bin probe.o
+
+# Assets of count files of size bytes, all different so nothing gets
+# deduplicated. Text files start with their number followed by lines of
+# lorem ipsum, random ones come from /dev/urandom.
+generate() {
+    rm -rf assets && mkdir assets
+    if [ "$3" = text ]; then
+        awk -v count="$1" -v size="$2" 'BEGIN {
+            line = " lorem ipsum dolor sit amet, consectetur adipiscing\n"
+            for (i = 0; i < count; i++) {
+                file = sprintf("assets/f%06d", i)
+                chunk = i line
+                for (left = size; left > 0; left -= length(part)) {
+                    part = substr(chunk, 1, left)
+                    printf "%s", part > file
+                    chunk = line
+                }
+                close(file)
+            }
+        }'
+    else
+        head -c $(($1 * $2)) /dev/urandom | split -b "$2" -a 6 -d - assets/f
+    fi
+    ls assets | awk '{ print "assets/" $0 " b " $0 }' > crp.conf
+    # name and name_len for every asset, like crp
+    ls assets | awk 'BEGIN { print ".section .rodata" }
+        {
+            print ".globl " $0 "\n.balign 4\n" $0 ":\n.incbin \"assets/" $0 "\""
+            print $0 "_end:\n.globl " $0 "_len\n.balign 4\n" $0 "_len:"
+            print ".quad " $0 "_end - " $0
+        }
+        END { print ".section .note.GNU-stack,\"\",@progbits" }' > incbin.S
+}
+
+# Runs method, the rest is the command, and records it.
+run() {
+    method=$1
+    output=$2
+    shift 2
+    rm -f "$output"
+    if ! measured=$(../measure "$@" | tail -n 1); then
+        echo "$method failed" >&2
+        return
+    fi
+    seconds=${measured% *}
+    peak_kib=${measured#* }
+    output_bytes=$(wc -c < "$output")
+    printf '%-8s %8s x %-6s %-6s %8ss %10s KiB %12s bytes\n' "$method" \
+        "$count" "$size" "$kind" "$seconds" "$peak_kib" "$output_bytes"
+    printf '{"rev":"%s","method":"%s","count":%s,"size":%s,"kind":"%s",' \
+        "$rev" "$method" "$count" "$(bytes "$size")" "$kind" >> "$results"
+    printf '"seconds":%s,"peak_rss_kib":%s,"output_bytes":%s}\n' \
+        "$seconds" "$peak_kib" "$output_bytes" >> "$results"
+}
+
+for kind in $KINDS; do
+    for size in $SIZES; do
+        for count in $COUNTS; do
+            total=$((count * $(bytes "$size")))
+            if [ "$total" -gt "$(bytes "$MAX_TOTAL")" ]; then
+                continue
+            fi
+            generate "$count" "$(bytes "$size")" "$kind"
+            run crp crp.o ../crp -q -c crp.conf crp.o
+            run incbin incbin.o "$CC" -c incbin.S -o incbin.o
+            if $has_ld_binary; then
+                run ld ld.o sh -c 'ld -r -b binary -o ld.o assets/*'
+            fi
+            if $has_xxd && [ "$total" -le "$(bytes "$XXD_MAX_TOTAL")" ]; then
+                run xxd xxd.o sh -c 'for f in assets/*; do xxd -i "$f"; done \
+                    > xxd.c && '"$CC"' -c xxd.c -o xxd.o'
+            fi
+        done
+    done
+done
+rm -rf assets crp.conf incbin.S xxd.c ./*.o
+echo "results appended to $results"
@@ -0,0 +1,50 @@
+# Times config parsing on a generated config of LINES lines (1M by default):
+# names, quoted paths, alignments and comments over a few small files, so
+# stat and writing stay cheap next to parsing. Prints the phases of the run
+# and appends a JSON line to build/bench/results.jsonl:
+#   LINES=200000 sh config.sh
+cd "$(dirname "$0")"
+LINES=${LINES:-1000000}
+CC=${CC:-cc}
+
+mkdir -p build/bench
+$CC -O2 -w -pthread ../crp.c -o build/crp || exit 1
+results=$PWD/build/bench/results.jsonl
+rev=$(git rev-parse --short HEAD 2> /dev/null || echo unknown)
+cd build/bench
+
+rm -rf config && mkdir -p "config/sub dir"
+for i in 0 1 2 3 4 5 6 7; do
+    printf 'asset %s\n' "$i" > "config/sub dir/file $i.txt"
+    printf 'asset %s\n' "$i" > "config/file_$i.bin"
+done
+awk -v lines="$LINES" 'BEGIN {
+    for (i = 0; i < lines; i++) {
+        f = i % 8
+        if (i % 100 == 0) {
+            print "# generated asset " i
+        } else if (i % 4 == 0) {
+            print "\"config/sub dir/file " f ".txt\" s text_" i
+        } else if (i % 4 == 1) {
+            print "config/file_" f ".bin b bin_" i " bin_" i "_size 16"
+        } else if (i % 4 == 2) {
+            print "  config/file_" f ".bin\tbw data_" i
+        } else {
+            print "config/file_" f ".bin b 64 aligned_" i
+        }
+    }
+}' > config.conf
+
+../crp -q -c config.conf --stats-json config.json config.o || exit 1
+parse_ms=$(sed 's/.*"name":"parse config","wall_ms":\([0-9.]*\).*/\1/' config.json)
+stat_ms=$(sed 's/.*"name":"stat assets","wall_ms":\([0-9.]*\).*/\1/' config.json)
+total_ms=$(sed 's/.*\],"wall_ms":\([0-9.]*\).*/\1/' config.json)
+peak_kib=$(sed 's/.*"peak_rss_kib":\([0-9]*\).*/\1/' config.json)
+printf 'config   %8s lines  parse %10s ms  stat %10s ms  total %10s ms  %10s KiB\n' \
+    "$LINES" "$parse_ms" "$stat_ms" "$total_ms" "$peak_kib"
+printf '{"rev":"%s","method":"config","lines":%s,"parse_ms":%s,' \
+    "$rev" "$LINES" "$parse_ms" >> "$results"
+printf '"stat_ms":%s,"total_ms":%s,"peak_rss_kib":%s}\n' \
+    "$stat_ms" "$total_ms" "$peak_kib" >> "$results"
+rm -rf config config.conf config.json config.o
+echo "results appended to $results"
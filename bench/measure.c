@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Runs a command and prints its wall time in seconds and peak RSS in KiB of
+// it and every process it waited for, e.g. cc1 and as under cc. Exits with
+// the status of the command.
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: measure command [args...]\n");
+        return 2;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == 0) {
+        execvp(argv[1], argv + 1);
+        fprintf(stderr, "can't run %s\n", argv[1]);
+        _exit(127);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    struct rusage usage;
+    getrusage(RUSAGE_CHILDREN, &usage);
+#ifdef __APPLE__
+    long peak_kib = usage.ru_maxrss / 1024; // bytes on macOS
+#else
+    long peak_kib = usage.ru_maxrss;
+#endif
+    printf("%.3f %ld\n",
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+           peak_kib);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
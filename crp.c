@@ -1,22 +1,109 @@
+#define _GNU_SOURCE
+#include "archive_writer.h"
+#include "arena.h"
 #include "dump.h"
+#include "hash.h"
+#include "lz4.h"
+#include "object.h"
+#include "pool.h"
+#include "runtime/crp.h"
 #include "sds.c"
+#include "stats.h"
 #include <ctype.h>
-#include <libgen.h>
-#include <mach-o/loader.h>
-#include <mach-o/nlist.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#if __has_include(<linux/fs.h>)
+#include <linux/fs.h>
+#endif
+
+#if __has_include(<mach-o/loader.h>)
+#include "macho_writer.h"
+#define CRP_HAS_MACHO 1
+#endif
+
+#if __has_include(<elf.h>)
+#include "elf_writer.h"
+#define CRP_HAS_ELF 1
+#endif
+
+// Regular file under the directory of a pack asset ('p'), named by its path
+// relative to the directory.
+typedef struct {
+    sds path;
+    sds name;
+    uint64_t size;
+    uint64_t hash; // crp_hash(name, 0)
+    uint64_t name_offset;
+    uint64_t offset; // of the content in the pack
+} PackFile;
+
+// Files of a pack in pack order: by name hash, then by name, see
+// crp_pack_find() in runtime/crp.h. index holds the start of the blob, the
+// count, entries and names, contents are read from files when they're
+// needed.
+typedef struct {
+    PackFile *files;
+    uint32_t count;
+    sds *dirs; // under the directory of the pack, for the depfile
+    uint32_t dirs_count;
+    uint8_t *index;
+    uint64_t index_size; // offset of the first content
+} Pack;
+
+// size is what the asset takes in the data section, len is the value of its
+// size variable. content holds generated bytes (compressed assets), other
+// assets are streamed from file_path. same_as is the index of the asset
+// whose bytes are shared by this one, suffix_of of the string this one is
+// the tail of, its own index if none. alignment is the one asked for in
+// config, 0 if none.
 #define Asset_FIELDS(X)                                                        \
     X(sds, file_path)                                                          \
     X(sds, var_name)                                                           \
     X(sds, var_size_name)                                                      \
+    X(char, type)                                                              \
+    X(bool, writable)                                                          \
+    X(uint64_t, alignment)                                                     \
+    X(uint64_t, file_size)                                                     \
+    X(int64_t, mtime)                                                          \
+    X(uint64_t, inode)                                                         \
+    X(uint64_t, device)                                                        \
+    X(uint64_t, hash)                                                          \
+    X(uint32_t, same_as)                                                       \
+    X(uint32_t, suffix_of)                                                     \
+    X(uint64_t, size)                                                          \
+    X(uint64_t, len)                                                           \
     X(void *, content)                                                         \
-    X(uint64_t, size)
+    X(uint64_t, spill_offset)                                                  \
+    X(Pack *, pack)                                                            \
+    X(uint32_t, section)                                                       \
+    X(uint64_t, offset)                                                        \
+    X(uint64_t, size_offset)
 DECLARE_STRUCT(Asset);
 
+// Where values of size variables live.
+typedef enum {
+    SIZES_INLINE,   // uint64_t after the content of every asset
+    SIZES_ABSOLUTE, // absolute symbols, no data at all
+    SIZES_TABLE,    // dense uint64_t table section ahead of contents
+} SizesMode;
+
+// with SIZES_TABLE, sections of assets follow it
+#define SIZE_TABLE_SECTION 0
+
 typedef struct {
     sds file_path;
     bool add_zero_at_the_end;
@@ -25,11 +112,12 @@ typedef struct {
 
 uint8_t *fread_all_fn(fread_all_args args) {
     FILE *file = fopen(args.file_path, "rb");
+    stats_io(0, 0);
     fseek(file, 0, SEEK_END);
     uint64_t file_size = ftell(file);
     fseek(file, 0, SEEK_SET);
     uint8_t *buf = malloc(file_size + args.add_zero_at_the_end);
-    fread(buf, 1, file_size, file);
+    stats_io(fread(buf, 1, file_size, file), 0);
     fclose(file);
     if (args.add_zero_at_the_end) {
         buf[file_size] = 0;
@@ -42,380 +130,3087 @@ uint8_t *fread_all_fn(fread_all_args args) {
 
 #define fread_all(...) fread_all_fn((fread_all_args){__VA_ARGS__})
 
-uint64_t ceil_to_alignment(uint64_t cur, uint64_t alignment) {
-    return (cur + alignment - 1) / alignment * alignment;
-}
+#ifdef __APPLE__
+#define STAT_MTIME(st) ((st).st_mtimespec)
+#else
+#define STAT_MTIME(st) ((st).st_mtim)
+#endif
 
 typedef struct {
-    FILE *file;
-    uint64_t cur;
-    uint8_t alignment;
-} fill_to_alignment_args;
+    uint64_t size;
+    int64_t mtime; // nanoseconds
+    uint64_t inode;
+    uint64_t device; // not kept in the cache
+} FileStat;
 
-void fill_to_alignment_fn(fill_to_alignment_args args) {
-    uint64_t to = ceil_to_alignment(args.cur, args.alignment);
-    if (args.cur < to) {
-        const uint8_t tmp[8] = {};
-        fwrite(tmp, 1, to - args.cur, args.file);
+bool try_stat_file(const char *file_path, FileStat *out) {
+    struct stat st;
+    stats_io(0, 0);
+    if (stat(file_path, &st) != 0) {
+        return false;
     }
+    *out = (FileStat){
+        .size = st.st_size,
+        .mtime = STAT_MTIME(st).tv_sec * 1000000000LL + STAT_MTIME(st).tv_nsec,
+        .inode = st.st_ino,
+        .device = st.st_dev,
+    };
+    return true;
 }
 
-#define fill_to_alignment(...)                                                 \
-    fill_to_alignment_fn((fill_to_alignment_args){__VA_ARGS__})
+FileStat stat_file(sds file_path) {
+    FileStat st;
+    if (!try_stat_file(file_path, &st)) {
+        fprintf(stderr, "can't stat %s\n", file_path);
+        exit(1);
+    }
+    return st;
+}
 
-Asset *load_assets(sds config_file_path, uint32_t *out_count) {
-    uint64_t config_size;
-    uint8_t *config =
-        fread_all(.file_path = config_file_path, .add_zero_at_the_end = true,
-                  .out_file_size = &config_size);
+// Parses sizes like 4096, 64K, 16M or 2G.
+uint64_t parse_size(const char *str) {
+    char *end;
+    uint64_t size = strtoull(str, &end, 10);
+    switch (toupper(*end)) {
+    case 'G':
+        size <<= 10;
+        // fallthrough
+    case 'M':
+        size <<= 10;
+        // fallthrough
+    case 'K':
+        size <<= 10;
+    }
+    return size;
+}
 
-    uint32_t lines_count;
-    sds *assets_configs =
-        sdssplitlen(config, config_size, "\n", 1, &lines_count);
+// Pack assets: every regular file under a directory in one blob, the
+// number of files, an index of crp_pack_entry of runtime/crp.h sorted by
+// name hash, names and contents, so a directory of 50k small files costs
+// two symbols. Contents aren't aligned.
 
-    uint32_t assets_count = 0;
-    for (uint32_t i = 0; i < lines_count; i++) {
-        sds trimmed = sdstrim(sdsdup(assets_configs[i]), " ");
-        if (sdscmp(trimmed, sdsempty()) != 0) {
-            assets_count += 1;
-        }
-        sdsfree(trimmed);
+// Appends path to a list grown as it fills.
+void walk_append(sds **list, uint32_t *count, sds path) {
+    // capacity is 16, then the next power of two
+    if (*count == 0 || (*count >= 16 && (*count & (*count - 1)) == 0)) {
+        *list = realloc(*list, (*count ? *count * 2 : 16) * sizeof(sds));
     }
-    *out_count = assets_count;
+    (*list)[(*count)++] = path;
+}
 
-    Asset *assets = calloc(assets_count, sizeof(Asset));
-    uint32_t asset_index = 0;
-    for (uint32_t i = 0; i < lines_count; i++) {
-        sds trimmed = sdstrim(sdsdup(assets_configs[i]), " ");
-        if (sdscmp(trimmed, sdsempty()) == 0) {
-            sdsfree(trimmed);
+int compare_sds(const void *a, const void *b) {
+    return strcmp(*(const sds *)a, *(const sds *)b);
+}
+
+// Appends regular files under dir to pack, names are prefixed with prefix.
+// Keeps the latest mtime of dir, directories and files in it in mtime, so
+// adding, removing or touching any of them shows.
+void walk_pack_dir(Pack *pack, uint32_t *capacity, sds dir, sds prefix,
+                   int64_t *mtime) {
+    DIR *d = opendir(dir);
+    stats_io(0, 0);
+    if (!d) {
+        fprintf(stderr, "can't open directory %s\n", dir);
+        exit(1);
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        if (strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        sds path = sdscatfmt(sdsdup(dir), "/%s", entry->d_name);
+        sds name = sdslen(prefix) > 0
+                       ? sdscatfmt(sdsdup(prefix), "/%s", entry->d_name)
+                       : sdsnew(entry->d_name);
+        struct stat st;
+        stats_io(0, 0);
+        if (lstat(path, &st) != 0) {
+            fprintf(stderr, "can't stat %s\n", path);
+            exit(1);
+        }
+        // symlinks to files are followed, to directories not, they can loop
+        const bool link = S_ISLNK(st.st_mode);
+        if (link) {
+            stats_io(0, 0);
+            if (stat(path, &st) != 0) {
+                fprintf(stderr, "can't stat %s\n", path);
+                exit(1);
+            }
+        }
+        const int64_t entry_mtime = STAT_MTIME(st).tv_sec * 1000000000LL +
+                                    STAT_MTIME(st).tv_nsec;
+        if (entry_mtime > *mtime) {
+            *mtime = entry_mtime;
+        }
+        if (S_ISDIR(st.st_mode) && !link) {
+            walk_pack_dir(pack, capacity, path, name, mtime);
+            walk_append(&pack->dirs, &pack->dirs_count, path);
+            sdsfree(name);
+            continue;
+        } else if (S_ISREG(st.st_mode)) {
+            if (pack->count == *capacity) {
+                *capacity = *capacity ? *capacity * 2 : 64;
+                pack->files =
+                    realloc(pack->files, *capacity * sizeof(PackFile));
+            }
+            pack->files[pack->count++] = (PackFile){
+                .path = path,
+                .name = name,
+                .size = st.st_size,
+            };
             continue;
         }
-        sdsfree(trimmed);
+        sdsfree(path);
+        sdsfree(name);
+    }
+    closedir(d);
+}
 
-        uint32_t parameters_count;
-        sds *parameters = sdssplitargs(assets_configs[i], &parameters_count);
+int compare_pack_file(const void *a, const void *b) {
+    const PackFile *file_a = a;
+    const PackFile *file_b = b;
+    if (file_a->hash != file_b->hash) {
+        return file_a->hash < file_b->hash ? -1 : 1;
+    }
+    return strcmp(file_a->name, file_b->name);
+}
 
-        sds file_path = sdsdup(parameters[0]);
+// Lists files of the pack asset and places them in the blob. Size of the
+// asset is the size of the blob, mtime the latest of everything in the
+// directory, inode a hash of names and sizes, so the cache notices any
+// change without reading files.
+void stat_pack(Asset *asset) {
+    Pack *pack = calloc(1, sizeof(Pack));
+    uint32_t capacity = 0;
+    FileStat dir_stat = stat_file(asset->file_path);
+    int64_t mtime = dir_stat.mtime;
+    sds prefix = sdsempty();
+    walk_pack_dir(pack, &capacity, asset->file_path, prefix, &mtime);
+    sdsfree(prefix);
 
-        char type = 'b';
-        if (parameters_count > 1) {
-            type = parameters[1][0];
+    for (uint32_t i = 0; i < pack->count; i++) {
+        pack->files[i].hash = crp_hash(pack->files[i].name, 0);
+    }
+    qsort(pack->files, pack->count, sizeof(PackFile), compare_pack_file);
+    qsort(pack->dirs, pack->dirs_count, sizeof(sds), compare_sds);
+    uint64_t cur = sizeof(uint64_t) + pack->count * sizeof(crp_pack_entry);
+    for (uint32_t i = 0; i < pack->count; i++) {
+        pack->files[i].name_offset = cur;
+        cur += sdslen(pack->files[i].name) + 1;
+    }
+    pack->index_size = cur;
+    Hasher h = hasher_new(0);
+    for (uint32_t i = 0; i < pack->count; i++) {
+        PackFile *file = &pack->files[i];
+        file->offset = cur;
+        cur += file->size;
+        hasher_update(&h, file->name, sdslen(file->name) + 1);
+        hasher_update(&h, &file->size, sizeof(file->size));
+    }
+
+    pack->index = malloc(pack->index_size);
+    const uint64_t count = pack->count;
+    memcpy(pack->index, &count, sizeof(count));
+    crp_pack_entry *entries =
+        (crp_pack_entry *)(pack->index + sizeof(count));
+    for (uint32_t i = 0; i < pack->count; i++) {
+        PackFile *file = &pack->files[i];
+        entries[i] = (crp_pack_entry){
+            .hash = file->hash,
+            .offset = file->offset,
+            .size = file->size,
+            .name = file->name_offset,
+        };
+        memcpy(pack->index + file->name_offset, file->name,
+               sdslen(file->name) + 1);
+    }
+
+    asset->pack = pack;
+    asset->file_size = cur;
+    asset->mtime = mtime;
+    asset->inode = hasher_digest(&h);
+    asset->size = asset->file_size;
+    asset->len = asset->size;
+}
+
+void stat_asset_task(void *ctx, uint32_t index) {
+    Asset *asset = &((Asset *)ctx)[index];
+    if (asset->type == 'p') {
+        stat_pack(asset);
+        return;
+    }
+    FileStat st = stat_file(asset->file_path);
+    asset->file_size = st.size;
+    asset->mtime = st.mtime;
+    asset->inode = st.inode;
+    asset->device = st.device;
+    asset->size = asset->file_size + (asset->type == 's'); // 's' gets 0 at end
+    asset->len = asset->size;
+}
+
+// Pattern entries, marked by 'g' after the type: a path with '*', '?' or
+// '[' in it stands for every regular file it matches, "**" for any number
+// of directories, and a path ending with '/' for every file under the
+// directory. The part before the first component with wildcards (the last
+// one if there are none) is the base directory, which is read
+// level by level, every level on jobs threads. readdir() fetches entries in
+// batches (getdents64 on Linux) and their types come with them, so only
+// symlinks and filesystems without d_type cost a stat. Directories no file
+// under which can match aren't read at all.
+
+typedef struct {
+    sds base;
+    sds *parts;   // components after base, NULL for every file
+    int parts_count;
+} Pattern;
+
+Pattern parse_pattern(const char *path) {
+    const uint64_t length = strlen(path);
+    if (path[length - 1] == '/') {
+        uint64_t end = length;
+        while (end > 1 && path[end - 1] == '/') {
+            end--;
+        }
+        return (Pattern){.base = sdsnewlen(path, end)};
+    }
+    // base ends at the last '/' before the first wildcard
+    const char *wildcard = strpbrk(path, "*?[");
+    const char *slash = wildcard ? wildcard : path + length;
+    while (slash > path && slash[-1] != '/') {
+        slash--;
+    }
+    Pattern pattern = {
+        .base = slash == path ? sdsnew(".")
+                : slash - 1 == path ? sdsnew("/")
+                                    : sdsnewlen(path, slash - 1 - path),
+    };
+    pattern.parts = sdssplitlen(slash, strlen(slash), "/", 1,
+                                &pattern.parts_count);
+    return pattern;
+}
+
+// Whether path, relative to the base, matches parts. With prefix, whether
+// something under the directory at path can. "**" doesn't go into hidden
+// directories, wildcards don't match a leading '.', like shells.
+bool pattern_match(sds *parts, int count, const char *path, bool prefix) {
+    const char *slash = strchr(path, '/');
+    if (count > 0 && strcmp(parts[0], "**") == 0) {
+        if (pattern_match(parts + 1, count - 1, path, prefix)) {
+            return true;
         }
+        if (path[0] == '.') {
+            return false;
+        }
+        // a trailing "**" matches files too
+        return slash ? pattern_match(parts, count, slash + 1, prefix)
+                     : prefix || count == 1;
+    }
+    if (count == 0) {
+        return false;
+    }
+    char component[NAME_MAX + 1];
+    const uint64_t length = slash ? (uint64_t)(slash - path) : strlen(path);
+    if (length > NAME_MAX) {
+        return false;
+    }
+    memcpy(component, path, length);
+    component[length] = 0;
+    if (fnmatch(parts[0], component, FNM_PERIOD) != 0) {
+        return false;
+    }
+    if (!slash) {
+        return prefix ? count > 1 : count == 1;
+    }
+    return pattern_match(parts + 1, count - 1, slash + 1, prefix);
+}
 
-        uint64_t size;
-        uint8_t *content = fread_all(.file_path = file_path,
-                                     .add_zero_at_the_end = type == 's',
-                                     .out_file_size = &size);
+// Directory of the tree, relative to the base ("" for the base), and what
+// reading it found.
+typedef struct {
+    sds path;
+    sds *files; // relative paths of matching regular files
+    uint32_t files_count;
+    sds *dirs; // subdirectories that may hold matches
+    uint32_t dirs_count;
+} WalkDir;
 
-        sds var_name;
-        if (parameters_count > 2) {
-            sds tmp = sdsdup(parameters[2]);
-            var_name = sdscat(sdsnew("_"), tmp);
-            sdsfree(tmp);
-        } else {
-            sds tmp = sdsdup(parameters[0]);
-            var_name = sdscat(sdsnew("_"), basename(tmp));
-            sdsfree(tmp);
-            for (int i = 0; i < sdslen(var_name); i++) {
-                if (!isalnum(var_name[i])) {
-                    var_name[i] = '_';
+typedef struct {
+    Pattern *pattern;
+    WalkDir *dirs;
+} WalkCtx;
+
+void walk_dir_task(void *ctx, uint32_t index) {
+    WalkCtx *c = ctx;
+    Pattern *pattern = c->pattern;
+    WalkDir *dir = &c->dirs[index];
+    sds dir_path = sdslen(dir->path) > 0
+                       ? sdscatfmt(sdsdup(pattern->base), "/%S", dir->path)
+                       : sdsdup(pattern->base);
+    DIR *d = opendir(dir_path);
+    stats_io(0, 0);
+    if (!d) {
+        fprintf(stderr, "can't open directory %s\n", dir_path);
+        exit(1);
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        if (strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        bool is_dir = entry->d_type == DT_DIR;
+        bool is_file = entry->d_type == DT_REG;
+        if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            stats_io(0, 0);
+            if (fstatat(dirfd(d), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) !=
+                0) {
+                continue;
+            }
+            const bool link = S_ISLNK(st.st_mode);
+            if (link) {
+                stats_io(0, 0);
+                if (fstatat(dirfd(d), entry->d_name, &st, 0) != 0) {
+                    continue; // dangling symlink
                 }
             }
+            // symlinks to directories aren't followed, they can loop
+            is_dir = S_ISDIR(st.st_mode) && !link;
+            is_file = S_ISREG(st.st_mode);
         }
-
-        sds var_size_name;
-        if (parameters_count > 3) {
-            var_size_name = sdscat(sdsnew("_"), parameters[3]);
+        if (!is_dir && !is_file) {
+            continue;
+        }
+        sds path = sdslen(dir->path) > 0
+                       ? sdscatfmt(sdsdup(dir->path), "/%s", entry->d_name)
+                       : sdsnew(entry->d_name);
+        if (is_dir && (!pattern->parts ||
+                       pattern_match(pattern->parts, pattern->parts_count,
+                                     path, true))) {
+            walk_append(&dir->dirs, &dir->dirs_count, path);
+        } else if (is_file &&
+                   (!pattern->parts ||
+                    pattern_match(pattern->parts, pattern->parts_count, path,
+                                  false))) {
+            walk_append(&dir->files, &dir->files_count, path);
         } else {
-            var_size_name = sdscatfmt(sdsempty(), "%S_len", var_name);
+            sdsfree(path);
         }
+    }
+    closedir(d);
+    sdsfree(dir_path);
+}
 
-        assets[asset_index] = (Asset){
-            .file_path = file_path,
-            .content = content,
-            .size = size,
-            .var_name = var_name,
-            .var_size_name = var_size_name,
-        };
-
-        asset_index += 1;
-        sdsfreesplitres(parameters, parameters_count);
+// Files matching pattern, relative to its base and sorted, so the order
+// doesn't depend on the filesystem or on jobs. Paths of directories read
+// are appended to dirs.
+sds *walk_pattern(Pattern *pattern, uint32_t jobs, uint32_t *out_count,
+                  sds **dirs, uint32_t *dirs_count) {
+    sds *files = NULL;
+    uint32_t files_count = 0;
+    WalkDir *level = calloc(1, sizeof(WalkDir));
+    level[0].path = sdsempty();
+    uint32_t level_count = 1;
+    while (level_count > 0) {
+        WalkCtx ctx = {.pattern = pattern, .dirs = level};
+        parallel_for(.threads_count = jobs, .count = level_count,
+                     .fn = walk_dir_task, .ctx = &ctx);
+        uint32_t next_count = 0;
+        for (uint32_t i = 0; i < level_count; i++) {
+            next_count += level[i].dirs_count;
+        }
+        WalkDir *next = calloc(next_count ? next_count : 1, sizeof(WalkDir));
+        next_count = 0;
+        for (uint32_t i = 0; i < level_count; i++) {
+            WalkDir *dir = &level[i];
+            for (uint32_t j = 0; j < dir->files_count; j++) {
+                walk_append(&files, &files_count, dir->files[j]);
+            }
+            for (uint32_t j = 0; j < dir->dirs_count; j++) {
+                next[next_count++].path = dir->dirs[j];
+            }
+            walk_append(dirs, dirs_count,
+                        sdslen(dir->path) > 0
+                            ? sdscatfmt(sdsdup(pattern->base), "/%S",
+                                        dir->path)
+                            : sdsdup(pattern->base));
+            sdsfree(dir->path);
+            free(dir->files);
+            free(dir->dirs);
+        }
+        free(level);
+        level = next;
+        level_count = next_count;
     }
-    sdsfreesplitres(assets_configs, lines_count);
-    return assets;
+    free(level);
+    qsort(files, files_count, sizeof(sds), compare_sds);
+    *out_count = files_count;
+    return files;
 }
 
+// Config parser, one pass over the mapped config. Lines are whitespace
+// separated columns quoted like sdssplitargs(): "..." with C escapes (\n,
+// \t, \xHH, ...), '...' with \' only, and a closing quote must end the
+// column. Blank lines and lines starting with '#' are skipped. Columns are
+// decoded into a scratch buffer as long as the longest line, kept ones are
+// copied to the arena, so nothing is allocated per line.
+
 typedef struct {
-    sds output_file;
-    sds config_file;
-    bool quiet;
-} Settings;
+    const char *p;   // where the next column starts
+    const char *end; // of the line, without '\n'
+    char *column;    // decoded, zero terminated
+    uint64_t column_len;
+} ConfigLine;
 
-Settings parse_args(int argc, char **argv) {
-    Settings settings = {
-        .config_file = sdsnew("crp.conf"),
-        .output_file = sdsnew("assets.o"),
-        .quiet = false,
-    };
+int config_hex_digit(char c) {
+    return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
 
-    for (int i = 1; i < argc; i++) {
-        if (argv[i][0] == '-') {
-            switch (argv[i][1]) {
-            case 'q':
-                settings.quiet = true;
-                break;
-            case 'c':
-                i++;
-                sdsfree(settings.config_file);
-                settings.config_file = sdsnew(argv[i]);
-                break;
+// Decodes the next column of line, false if there is none.
+bool config_column(ConfigLine *line, sds config_path, uint32_t line_number) {
+    const char *p = line->p;
+    const char *end = line->end;
+    while (p < end && isspace(*p)) {
+        p++;
+    }
+    if (p == end) {
+        line->p = p;
+        return false;
+    }
+    char *out = line->column;
+    bool in_quotes = false;
+    bool in_single_quotes = false;
+    for (bool done = false; !done; p++) {
+        if (in_quotes || in_single_quotes) {
+            if (p == end) {
+                fprintf(stderr, "%s:%u: unterminated quotes\n", config_path,
+                        line_number);
+                exit(1);
+            }
+            const char quote = in_quotes ? '"' : '\'';
+            if (in_quotes && *p == '\\' && end - p >= 4 && p[1] == 'x' &&
+                isxdigit(p[2]) && isxdigit(p[3])) {
+                *out++ = config_hex_digit(p[2]) * 16 + config_hex_digit(p[3]);
+                p += 3;
+            } else if (in_quotes && *p == '\\' && p + 1 < end) {
+                p++;
+                switch (*p) {
+                case 'n':
+                    *out++ = '\n';
+                    break;
+                case 'r':
+                    *out++ = '\r';
+                    break;
+                case 't':
+                    *out++ = '\t';
+                    break;
+                case 'b':
+                    *out++ = '\b';
+                    break;
+                case 'a':
+                    *out++ = '\a';
+                    break;
+                default:
+                    *out++ = *p;
+                    break;
+                }
+            } else if (in_single_quotes && *p == '\\' && p + 1 < end &&
+                       p[1] == '\'') {
+                *out++ = *++p;
+            } else if (*p == quote) {
+                if (p + 1 < end && !isspace(p[1])) {
+                    fprintf(stderr,
+                            "%s:%u: closing quote must be followed by a "
+                            "space\n",
+                            config_path, line_number);
+                    exit(1);
+                }
+                done = true;
+            } else {
+                *out++ = *p;
             }
+        } else if (p == end || *p == ' ' || *p == '\r' || *p == '\t') {
+            done = true;
+        } else if (*p == '"') {
+            in_quotes = true;
+        } else if (*p == '\'') {
+            in_single_quotes = true;
         } else {
-            sdsfree(settings.output_file);
-            settings.output_file = sdsnew(argv[i]);
+            *out++ = *p;
+        }
+        if (p == end) {
+            break;
         }
     }
-    return settings;
+    *out = 0;
+    line->column_len = out - line->column;
+    line->p = p < end ? p : end;
+    return true;
 }
 
-int main(int argc, char **argv) {
-    uint32_t assets_count;
+// basename() of path, with everything but letters and digits replaced by
+// '_', in to.
+uint64_t default_var_name(char *to, sds path) {
+    uint64_t end = sdslen(path);
+    while (end > 1 && path[end - 1] == '/') {
+        end--;
+    }
+    uint64_t start = end;
+    while (start > 0 && path[start - 1] != '/') {
+        start--;
+    }
+    if (end == 0) {
+        to[0] = '.';
+        return 1;
+    }
+    if (start == end) {
+        start = end - 1; // only slashes
+    }
+    for (uint64_t i = start; i < end; i++) {
+        to[i - start] = isalnum(path[i]) ? path[i] : '_';
+    }
+    return end - start;
+}
 
-    Settings settings = parse_args(argc, argv);
-    Asset *assets = load_assets(settings.config_file, &assets_count);
-    if (!settings.quiet) {
-        printf("assets count: %d\n", assets_count);
-        for (uint32_t i = 0; i < assets_count; i++) {
-            printf("%d:", i);
-            DUMP(assets[i], Asset);
+// Parses config and collects sizes of assets (on jobs threads), content is
+// streamed later by the writer. Assets and their strings live in arena.
+// Directories read for patterns go to dirs.
+typedef struct {
+    sds name;
+    uint32_t index;
+} NameIndex;
+
+int compare_name_index(const void *a, const void *b) {
+    const NameIndex *x = a;
+    const NameIndex *y = b;
+    const int order = strcmp(x->name, y->name);
+    return order != 0 ? order : x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Names made of paths can collide, "a/b_c" and "a/b/c" are both a_b_c, or
+// take the name of another asset. Exits if any asset of a pattern, ranges
+// of which are pairs of first index and count in expanded, shares its name.
+void check_expanded_names(Asset *assets, uint32_t assets_count,
+                          uint32_t *expanded, uint32_t expanded_count) {
+    bool *from_pattern = calloc(assets_count ? assets_count : 1, sizeof(bool));
+    for (uint32_t i = 0; i < expanded_count; i += 2) {
+        memset(from_pattern + expanded[i], true, expanded[i + 1]);
+    }
+    NameIndex *names = malloc((assets_count ? assets_count : 1) *
+                              sizeof(NameIndex));
+    for (uint32_t i = 0; i < assets_count; i++) {
+        names[i] = (NameIndex){.name = assets[i].var_name, .index = i};
+    }
+    qsort(names, assets_count, sizeof(NameIndex), compare_name_index);
+    for (uint32_t i = 1; i < assets_count; i++) {
+        if ((from_pattern[names[i].index] ||
+             from_pattern[names[i - 1].index]) &&
+            strcmp(names[i].name, names[i - 1].name) == 0) {
+            fprintf(stderr, "%s and %s are both named %s\n",
+                    assets[names[i - 1].index].file_path,
+                    assets[names[i].index].file_path, names[i].name);
+            exit(1);
         }
     }
+    free(names);
+    free(from_pattern);
+}
 
-    const char local_symbols_str[] = "\0ltmp1\0ltmp0";
-    uint32_t symbol_names_length = sizeof(local_symbols_str);
-    for (uint32_t i = 0; i < assets_count; i++) {
-        symbol_names_length += sdslen(assets[i].var_name) + 1 +
-                               sdslen(assets[i].var_size_name) + 1;
+Asset *load_assets(sds config_file_path, Arena *arena, uint32_t jobs,
+                   uint32_t *out_count, sds **dirs, uint32_t *dirs_count) {
+    int fd = open(config_file_path, O_RDONLY);
+    stats_io(0, 0);
+    struct stat config_stat;
+    if (fd < 0 || fstat(fd, &config_stat) != 0) {
+        fprintf(stderr, "can't open %s\n", config_file_path);
+        exit(1);
+    }
+    stats_io(0, 0);
+    const uint64_t config_size = config_stat.st_size;
+    const char *config = "";
+    if (config_size > 0) {
+        config = mmap(NULL, config_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (config == MAP_FAILED) {
+            fprintf(stderr, "can't map %s\n", config_file_path);
+            exit(1);
+        }
+        madvise((void *)config, config_size, MADV_SEQUENTIAL);
+        stats_io(config_size, 0);
     }
+    close(fd);
 
-    const uint32_t align = 2;
-    const uint32_t alignment = 1 << align; // align = 2
-    uint64_t assets_content_aligned_size = 0;
-    for (uint32_t i = 0; i < assets_count; i++) {
-        assets_content_aligned_size +=
-            ceil_to_alignment(assets[i].size, alignment);
-        assets_content_aligned_size +=
-            ceil_to_alignment(sizeof(assets[i].size), alignment);
-    }
-
-    const uint32_t sizeofcmds =
-        sizeof(struct segment_command_64) + sizeof(struct section_64) * 2 +
-        sizeof(struct build_version_command) + sizeof(struct symtab_command) +
-        sizeof(struct dysymtab_command);
-    const uint32_t data_offset = sizeof(struct mach_header_64) + sizeofcmds;
-    const uint32_t sym_table_offset =
-        data_offset + ceil_to_alignment(assets_content_aligned_size,
-                                        sizeof(long)); // todo: calc % 8
-    const uint32_t sym_str_offset =
-        sym_table_offset + sizeof(struct nlist_64) * (assets_count * 2 + 2);
-
-    FILE *out_object_file = fopen(settings.output_file, "wb");
-
-    {
-        struct mach_header_64 m_header = {
-            .magic = MH_MAGIC_64,
-            .cputype = CPU_TYPE_ARM64,
-            .cpusubtype = CPU_SUBTYPE_ARM64_ALL,
-            .filetype = MH_OBJECT,
-            .ncmds = 4,
-            .sizeofcmds = sizeofcmds,
-            .flags = MH_SUBSECTIONS_VIA_SYMBOLS,
-        };
-        fwrite(&m_header, sizeof(struct mach_header_64), 1, out_object_file);
-    }
-    {
-        struct segment_command_64 load_command_segment = {
-            .cmd = LC_SEGMENT_64,
-            .cmdsize = (sizeof(struct section_64) * 2 +
-                        sizeof(struct segment_command_64)),
-            .segname = {},
-            .vmaddr = 0,
-            .vmsize = assets_content_aligned_size,
-            .fileoff = data_offset,
-            .filesize = assets_content_aligned_size,
-            .maxprot = VM_PROT_ALL,
-            .initprot = VM_PROT_ALL,
-            .nsects = 2,
-            .flags = 0,
-        };
-        fwrite(&load_command_segment, sizeof(struct segment_command_64), 1,
-               out_object_file);
-    }
-    {
-        struct section_64 section_text = {
-            .sectname = SECT_TEXT,
-            .segname = SEG_TEXT,
-            .addr = 0,
-            .size = 0,
-            .offset = data_offset,
-            .align = 0,
-            .reloff = 0,
-            .nreloc = 0,
-            .flags = S_ATTR_PURE_INSTRUCTIONS,
-            .reserved1 = 0,
-            .reserved2 = 0,
-            .reserved3 = 0,
+    // records for every line, in one piece of the arena
+    const char *config_end = config + config_size;
+    uint64_t lines_count = 1;
+    for (const char *p = config;
+         (p = memchr(p, '\n', config_end - p)) != NULL; p++) {
+        lines_count++;
+    }
+    uint64_t assets_capacity = lines_count;
+    Asset *assets = arena_alloc(arena, assets_capacity * sizeof(Asset),
+                                _Alignof(Asset));
+    uint32_t assets_count = 0;
+
+    char *scratch = NULL;
+    uint64_t scratch_capacity = 0;
+    uint32_t line_number = 0;
+    uint32_t *expanded = NULL; // first asset and count of every pattern
+    uint32_t expanded_count = 0;
+    for (const char *p = config; p < config_end;) {
+        const char *eol = memchr(p, '\n', config_end - p);
+        if (!eol) {
+            eol = config_end;
+        }
+        ConfigLine line = {.p = p, .end = eol};
+        p = eol + 1;
+        line_number++;
+        while (line.p < line.end && isspace(*line.p)) {
+            line.p++;
+        }
+        if (line.p == line.end || *line.p == '#') {
+            continue;
+        }
+        // columns and the default size name ("_len") fit
+        if (scratch_capacity < (uint64_t)(line.end - line.p) + 5) {
+            scratch_capacity = (line.end - line.p + 5) * 2;
+            scratch = realloc(scratch, scratch_capacity);
+        }
+        line.column = scratch;
+
+        config_column(&line, config_file_path, line_number);
+        sds file_path = arena_sds(arena, line.column, line.column_len);
+
+        // type letter, optionally followed by 'w' for assets patched at
+        // runtime and 'g' for patterns
+        char type = 'b';
+        bool writable = false;
+        bool glob = false;
+        if (config_column(&line, config_file_path, line_number)) {
+            type = line.column[0];
+            writable = type != 0 && strchr(line.column + 1, 'w') != NULL;
+            glob = type != 0 && strchr(line.column + 1, 'g') != NULL;
+        }
+
+        // names can't start with a digit, so such a column is alignment of
+        // the content: 16, 64, 4K, 2M
+        uint64_t alignment = 0;
+        sds names[2];
+        uint32_t names_count = 0;
+        while (config_column(&line, config_file_path, line_number)) {
+            if (isdigit(line.column[0])) {
+                alignment = parse_size(line.column);
+                if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+                    fprintf(stderr,
+                            "alignment of %s is not a power of two: %s\n",
+                            file_path, line.column);
+                    exit(1);
+                }
+            } else if (names_count < 2) {
+                names[names_count++] =
+                    arena_sds(arena, line.column, line.column_len);
+            }
+        }
+
+        if (glob) {
+            if (type == 'p' || sdslen(file_path) == 0 || names_count > 1) {
+                fprintf(stderr,
+                        "%s:%u: a pattern takes a path, a type other than "
+                        "'p' and a name prefix, size names are <name>_len\n",
+                        config_file_path, line_number);
+                exit(1);
+            }
+            Pattern pattern = parse_pattern(file_path);
+            uint32_t files_count;
+            sds *files = walk_pattern(&pattern, jobs, &files_count, dirs,
+                                      dirs_count);
+            if (files_count == 0) {
+                fprintf(stderr, "%s:%u: warning: %s matches no files\n",
+                        config_file_path, line_number, file_path);
+            }
+            // room for the files and a record for every line left
+            const uint64_t needed =
+                assets_count + files_count + lines_count - line_number;
+            if (needed > assets_capacity) {
+                assets_capacity = needed > assets_capacity * 2
+                                      ? needed
+                                      : assets_capacity * 2;
+                Asset *grown =
+                    arena_alloc(arena, assets_capacity * sizeof(Asset),
+                                _Alignof(Asset));
+                memcpy(grown, assets, assets_count * sizeof(Asset));
+                assets = grown;
+            }
+            // named after the path relative to the base, mangled like
+            // basenames, after the prefix: the name column or the name of
+            // the base, with '_' in front of a leading digit
+            const char *prefix = names_count > 0 ? names[0] : scratch;
+            uint64_t prefix_length = names_count > 0 ? sdslen(names[0]) : 0;
+            if (names_count == 0 && strcmp(pattern.base, ".") != 0 &&
+                strcmp(pattern.base, "/") != 0) {
+                prefix_length = default_var_name(scratch, pattern.base);
+                scratch[prefix_length++] = '_';
+            }
+            const char *separator =
+                pattern.base[sdslen(pattern.base) - 1] == '/' ? "" : "/";
+            for (uint32_t j = 0; j < files_count; j++) {
+                const sds file = files[j];
+                const bool digit = isdigit(
+                    prefix_length > 0 ? prefix[0] : file[0]);
+                sds var_name = arena_sdsalloc(
+                    arena, digit + prefix_length + sdslen(file));
+                var_name[0] = '_';
+                memcpy(var_name + digit, prefix, prefix_length);
+                for (uint64_t k = 0; k < sdslen(file); k++) {
+                    var_name[digit + prefix_length + k] =
+                        isalnum(file[k]) ? file[k] : '_';
+                }
+                assets[assets_count] = (Asset){
+                    .file_path =
+                        strcmp(pattern.base, ".") == 0
+                            ? arena_sds(arena, file, sdslen(file))
+                            : arena_sdsprintf(arena, "%s%s%s", pattern.base,
+                                              separator, file),
+                    .type = type,
+                    .writable = writable,
+                    .alignment = alignment,
+                    .same_as = assets_count,
+                    .suffix_of = assets_count,
+                    .var_name = var_name,
+                    .var_size_name = arena_sdsprintf(arena, "%s_len",
+                                                     var_name),
+                };
+                assets_count++;
+                sdsfree(file);
+            }
+            expanded = realloc(expanded,
+                               (expanded_count + 2) * sizeof(uint32_t));
+            expanded[expanded_count++] = assets_count - files_count;
+            expanded[expanded_count++] = files_count;
+            free(files);
+            sdsfree(pattern.base);
+            sdsfreesplitres(pattern.parts, pattern.parts_count);
+            continue;
+        }
+
+        // names are stored without the platform prefix, writers add it
+        sds var_name = names_count > 0
+                           ? names[0]
+                           : arena_sds(arena, scratch,
+                                       default_var_name(scratch, file_path));
+        sds var_size_name = names_count > 1 ? names[1] : NULL;
+        if (!var_size_name) {
+            memcpy(scratch, var_name, sdslen(var_name));
+            memcpy(scratch + sdslen(var_name), "_len", 4);
+            var_size_name = arena_sds(arena, scratch, sdslen(var_name) + 4);
+        }
+
+        if (type == 'p' && alignment == 0) {
+            alignment = sizeof(uint64_t); // the index is read in place
+        }
+
+        assets[assets_count] = (Asset){
+            .file_path = file_path,
+            .type = type,
+            .writable = writable,
+            .alignment = alignment,
+            .same_as = assets_count,
+            .suffix_of = assets_count,
+            .var_name = var_name,
+            .var_size_name = var_size_name,
         };
-        fwrite(&section_text, sizeof(struct section_64), 1, out_object_file);
-    }
-    {
-        struct section_64 section_data = {
-            .sectname = SECT_DATA,
-            .segname = SEG_DATA,
-            .addr = 0,
-            .size = assets_content_aligned_size,
-            .offset = data_offset,
-            .align = align,
-            .reloff = 0,
-            .nreloc = 0,
-            .flags = 0,
-            .reserved1 = 0,
-            .reserved2 = 0,
-            .reserved3 = 0,
+        assets_count++;
+    }
+    free(scratch);
+    if (config_size > 0) {
+        munmap((void *)config, config_size);
+    }
+    if (expanded_count > 0) {
+        check_expanded_names(assets, assets_count, expanded, expanded_count);
+        free(expanded);
+    }
+    *out_count = assets_count;
+
+    stats_phase("stat assets");
+    parallel_for(.threads_count = jobs, .count = assets_count,
+                 .fn = stat_asset_task, .ctx = assets);
+    return assets;
+}
+
+// Read-only assets go to .rodata (__TEXT,__const), which is mapped without
+// write access, so its pages stay clean and are shared through the page
+// cache by every process running the binary. Writable assets get .data
+// (__DATA,__data). Only used sections are created, but at least one.
+// SIZES_TABLE puts sizes of all assets, in config order, in a section of
+// their own ahead of them, so scanning sizes touches a few cache lines
+// instead of a page per asset. Returns the sections, sizes of asset
+// sections are filled by layout_assets().
+Section *assets_sections(Asset *assets, uint32_t assets_count,
+                         SizesMode sizes, uint32_t *out_count) {
+    bool any_const = assets_count == 0;
+    bool any_data = false;
+    for (uint32_t i = 0; i < assets_count; i++) {
+        any_const |= !assets[i].writable;
+        any_data |= assets[i].writable;
+    }
+    Section *sections = calloc(3, sizeof(Section));
+    uint32_t count = 0;
+    if (sizes == SIZES_TABLE) {
+        sections[count++] = (Section){
+            .name = ".rodata.crp_sizes",
+            .segname = "__TEXT",
+            .sectname = "__crp_sizes",
+            .size = assets_count * sizeof(uint64_t),
+            .align = 3,
+            .writable = false,
         };
-        fwrite(&section_data, sizeof(struct section_64), 1, out_object_file);
-    }
-    {
-        struct build_version_command command_build_version = {
-            .cmd = LC_BUILD_VERSION,
-            .cmdsize = sizeof(struct build_version_command),
-            .platform = PLATFORM_MACOS,
-            .minos = 0x000e0000,
-            .sdk = 0x000f0200,
-            .ntools = 0,
+    }
+    const uint32_t first = count;
+    if (any_const) {
+        sections[count++] = (Section){
+            .name = ".rodata",
+            .segname = "__TEXT",
+            .sectname = "__const",
+            .writable = false,
         };
-        fwrite(&command_build_version, sizeof(struct build_version_command), 1,
-               out_object_file);
-    }
-    {
-        struct symtab_command load_command_symtab = {
-            .cmd = LC_SYMTAB,
-            .cmdsize = sizeof(struct symtab_command),
-            .symoff = sym_table_offset,
-            .nsyms = assets_count * 2 +
-                     2, // symbols and their sizes symbols + local symbols,
-            .stroff = sym_str_offset,
-            .strsize = ceil_to_alignment(symbol_names_length, sizeof(long)),
+    }
+    if (any_data) {
+        sections[count++] = (Section){
+            .name = ".data",
+            .segname = "__DATA",
+            .sectname = "__data",
+            .writable = true,
         };
-        fwrite(&load_command_symtab, sizeof(struct symtab_command), 1,
-               out_object_file);
-    }
-    {
-        struct dysymtab_command load_command_dysymtab = {
-            .cmd = LC_DYSYMTAB,
-            .cmdsize = sizeof(struct dysymtab_command),
-            .ilocalsym = 0,
-            .nlocalsym = 2,
-            .iextdefsym = 2,
-            .nextdefsym = assets_count * 2,
-            .iundefsym = assets_count * 2 + 2,
-            .nundefsym = 0,
-            .tocoff = 0,
-            .ntoc = 0,
-            .modtaboff = 0,
-            .nmodtab = 0,
-            .extrefsymoff = 0,
-            .nextrefsyms = 0,
-            .indirectsymoff = 0,
-            .nindirectsyms = 0,
-            .extreloff = 0,
-            .nextrel = 0,
-            .locreloff = 0,
-            .nlocrel = 0,
+    }
+    for (uint32_t i = 0; i < assets_count; i++) {
+        assets[i].section = first + (assets[i].writable && any_const);
+    }
+    *out_count = count;
+    return sections;
+}
+
+// Same as assets_sections(), but every asset and its size get a section of
+// their own, .rodata.crp.<name> or .data.crp.<name>, so linkers drop assets
+// nothing references (--gc-sections). Tails of strings and duplicates stay
+// in the section of the content they point into. Names live in arena.
+Section *per_asset_sections(Asset *assets, uint32_t assets_count,
+                            SizesMode sizes, Arena *arena,
+                            uint32_t *out_count) {
+    if (assets_count == 0) {
+        return assets_sections(assets, assets_count, sizes, out_count);
+    }
+    Section *sections = calloc(assets_count + 1, sizeof(Section));
+    uint32_t count = 0;
+    if (sizes == SIZES_TABLE) {
+        sections[count++] = (Section){
+            .name = ".rodata.crp_sizes",
+            .segname = "__TEXT",
+            .sectname = "__crp_sizes",
+            .size = assets_count * sizeof(uint64_t),
+            .align = 3,
+            .writable = false,
         };
-        fwrite(&load_command_dysymtab, sizeof(struct dysymtab_command), 1,
-               out_object_file);
     }
-    {
-        for (uint32_t i = 0; i < assets_count; i++) {
-            fwrite(assets[i].content, 1, assets[i].size, out_object_file);
-            fill_to_alignment(.file = out_object_file, .cur = assets[i].size,
-                              alignment);
-            fwrite(&assets[i].size, sizeof(assets[i].size), 1, out_object_file);
-            fill_to_alignment(.file = out_object_file,
-                              .cur = sizeof(assets[i].size), alignment);
-        }
-
-        fill_to_alignment(.file = out_object_file,
-                          .cur = assets_content_aligned_size,
-                          .alignment = sizeof(long));
-    }
-
-    {
-        struct nlist_64 local_symbols[] = {
-            {
-             .n_un.n_strx = 1,
-             .n_type = N_TYPE & N_SECT,
-             .n_sect = 1,
-             .n_desc = 0,
-             .n_value = 0,
-             },
-            {
-             .n_un.n_strx = 7,
-             .n_type = N_TYPE & N_SECT,
-             .n_sect = 2,
-             .n_desc = 0,
-             .n_value = 0,
-             }
+    for (uint32_t i = 0; i < assets_count; i++) {
+        Asset *asset = &assets[i];
+        if (asset->same_as != i || asset->suffix_of != i) {
+            continue;
+        }
+        asset->section = count;
+        sections[count++] = (Section){
+            .name = arena_sdsprintf(arena, "%s.crp.%s",
+                                    asset->writable ? ".data" : ".rodata",
+                                    asset->var_name),
+            .segname = asset->writable ? "__DATA" : "__TEXT",
+            .sectname = asset->writable ? "__data" : "__const",
+            .writable = asset->writable,
         };
+    }
+    // originals of duplicates may be tails of strings themselves
+    for (uint32_t i = 0; i < assets_count; i++) {
+        uint32_t root = assets[assets[i].same_as].suffix_of;
+        assets[i].section = assets[root].section;
+    }
+    *out_count = count;
+    return sections;
+}
 
-        struct nlist_64 *symbols_table =
-            calloc(sizeof(struct nlist_64), assets_count * 2);
-        uint32_t current_pos = 13;
-        uint64_t current_offset = 0;
-        for (uint32_t i = 0; i < assets_count; i++) {
-            symbols_table[i * 2] = (struct nlist_64){
-                .n_un.n_strx = current_pos,
-                .n_type = N_TYPE & N_SECT | N_EXT,
-                .n_sect = 2,
-                .n_desc = 0,
-                .n_value = current_offset,
-            };
-            current_pos += sdslen(assets[i].var_name) + 1;
-            current_offset += ceil_to_alignment(assets[i].size, alignment);
-
-            symbols_table[i * 2 + 1] = (struct nlist_64){
-                .n_un.n_strx = current_pos,
-                .n_type = N_TYPE & N_SECT | N_EXT,
-                .n_sect = 2,
-                .n_desc = 0,
-                .n_value = current_offset,
-            };
-            current_pos += sdslen(assets[i].var_size_name) + 1;
-            current_offset +=
-                ceil_to_alignment(sizeof(assets[i].size), alignment);
+// Assigns every asset and its size a place in its section, sets sizes and
+// alignments of asset sections. Contents are placed in order and start at
+// 1 << align or their own alignment if bigger, sizes at alignment, unless
+// sizes live elsewhere. Tails of strings are placed once their strings are,
+// and duplicates once their originals are.
+void layout_assets(Asset *assets, uint32_t assets_count, uint32_t *order,
+                   Section *sections, uint32_t sections_count,
+                   uint32_t alignment, uint32_t align, SizesMode sizes) {
+    const uint32_t first = sizes == SIZES_TABLE ? SIZE_TABLE_SECTION + 1 : 0;
+    for (uint32_t i = first; i < sections_count; i++) {
+        sections[i].align = align;
+    }
+    uint64_t *current_offsets = calloc(sections_count, sizeof(uint64_t));
+    for (int pass = 0; pass < 3; pass++) {
+        for (uint32_t k = 0; k < assets_count; k++) {
+            const uint32_t i = order[k];
+            Asset *asset = &assets[i];
+            Section *section = &sections[asset->section];
+            uint64_t *current_offset = &current_offsets[asset->section];
+            const bool duplicate = asset->same_as != i;
+            const bool suffix = !duplicate && asset->suffix_of != i;
+            if (pass != (duplicate ? 2 : suffix ? 1 : 0)) {
+                continue;
+            }
+            if (duplicate) {
+                // sizes too, content of the original may be compressed
+                Asset *original = &assets[asset->same_as];
+                asset->size = original->size;
+                asset->len = original->len;
+                asset->offset = original->offset;
+                asset->size_offset = original->size_offset;
+                continue;
+            }
+            if (suffix) {
+                Asset *string = &assets[asset->suffix_of];
+                asset->offset = string->offset + string->size - asset->size;
+            } else {
+                if (asset->alignment > 1ULL << section->align) {
+                    section->align = __builtin_ctzll(asset->alignment);
+                }
+                asset->offset = ceil_to_alignment(
+                    *current_offset, asset->alignment > 1ULL << align
+                                         ? asset->alignment
+                                         : 1ULL << align);
+                *current_offset = asset->offset + asset->size;
+            }
+            if (sizes == SIZES_INLINE) {
+                asset->size_offset =
+                    ceil_to_alignment(*current_offset, alignment);
+                *current_offset = asset->size_offset + sizeof(asset->size);
+            }
         }
+    }
+    for (uint32_t i = first; i < sections_count; i++) {
+        sections[i].size = ceil_to_alignment(current_offsets[i], alignment);
+    }
+    free(current_offsets);
+}
 
-        fwrite(local_symbols, sizeof(struct nlist_64), 2, out_object_file);
-        fwrite(symbols_table, sizeof(struct nlist_64), assets_count * 2,
-               out_object_file);
+// Reads size bytes at offset of file at path open as in_fd to to.
+void read_file_content(uint8_t *to, int in_fd, uint64_t offset, uint64_t size,
+                       const char *path) {
+    uint64_t copied = 0;
+    while (copied < size) {
+        ssize_t count =
+            pread(in_fd, to + copied, size - copied, offset + copied);
+        stats_io(count > 0 ? count : 0, 0);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            fprintf(stderr, "can't read %s\n", path);
+            exit(1);
+        }
+        copied += count;
     }
+}
 
-    {
-        fwrite(local_symbols_str, 1, sizeof(local_symbols_str),
-               out_object_file);
-        for (uint32_t i = 0; i < assets_count; i++) {
-            fwrite(assets[i].var_name, 1, sdslen(assets[i].var_name) + 1,
-                   out_object_file);
-            fwrite(assets[i].var_size_name, 1,
-                   sdslen(assets[i].var_size_name) + 1, out_object_file);
+// Reads asset straight into the mapped output.
+void read_asset_content(uint8_t *to, int in_fd, Asset *asset) {
+    read_file_content(to, in_fd, 0, asset->file_size, asset->file_path);
+}
+
+// Places size bytes at in_offset of file at path open as in_fd at
+// out_offset of the output. Mapped output is filled by reading into it.
+// Otherwise tries to share blocks with the source (reflink) when both
+// offsets are block aligned, then copies in kernel with copy_file_range,
+// and falls back to pwrite from mapped windows of at most window_size
+// bytes.
+void copy_file_content(Output *out, uint64_t out_offset, int in_fd,
+                       uint64_t in_offset, uint64_t size, uint64_t window_size,
+                       const char *path) {
+    out_offset += out->base;
+    if (out->map) {
+        read_file_content(out->map + out_offset, in_fd, in_offset, size, path);
+        stats_mapped_write(size);
+        return;
+    }
+    const int out_fd = out->fd;
+    uint64_t copied = 0;
+
+#ifdef FICLONERANGE
+    struct stat out_stat;
+    stats_io(0, 0);
+    if (fstat(out_fd, &out_stat) == 0 && out_stat.st_blksize > 0 &&
+        out_offset % out_stat.st_blksize == 0 &&
+        in_offset % out_stat.st_blksize == 0) {
+        // unaligned tail is left to the copy below
+        uint64_t clone_length = size / out_stat.st_blksize * out_stat.st_blksize;
+        struct file_clone_range range = {
+            .src_fd = in_fd,
+            .src_offset = in_offset,
+            .src_length = clone_length,
+            .dest_offset = out_offset,
+        };
+        if (clone_length > 0 && ioctl(out_fd, FICLONERANGE, &range) == 0) {
+            stats_io(clone_length, clone_length);
+            copied = clone_length;
+        } else if (clone_length > 0) {
+            stats_io(0, 0);
+        }
+    }
+#endif
+
+#ifdef __linux__
+    while (copied < size) {
+        loff_t from_offset = in_offset + copied;
+        loff_t to_offset = out_offset + copied;
+        ssize_t count = copy_file_range(in_fd, &from_offset, out_fd,
+                                        &to_offset, size - copied, 0);
+        stats_io(count > 0 ? count : 0, count > 0 ? count : 0);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            break; // not supported for these files, copy it by hand
+        }
+        copied += count;
+    }
+#endif
+
+    const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    while (copied < size) {
+        const uint64_t position = in_offset + copied;
+        uint64_t map_offset = position / page_size * page_size;
+        uint64_t length = in_offset + size - map_offset;
+        if (length > window_size) {
+            length = window_size;
+        }
+        uint8_t *window =
+            mmap(NULL, length, PROT_READ, MAP_PRIVATE, in_fd, map_offset);
+        if (window == MAP_FAILED) {
+            fprintf(stderr, "can't map %s\n", path);
+            exit(1);
         }
+        madvise(window, length, MADV_SEQUENTIAL);
+        uint64_t skip = position - map_offset;
+        stats_io(length - skip, 0); // mmap, pages are read on access
+        pwrite_all(out_fd, window + skip, length - skip, out_offset + copied);
+        munmap(window, length);
+        copied = map_offset + length - in_offset;
+    }
+}
 
-        fill_to_alignment(.file = out_object_file, .cur = symbol_names_length,
-                          .alignment = sizeof(long));
+// Places the file of asset at out_offset of the output.
+void copy_asset_content(Output *out, uint64_t out_offset, Asset *asset,
+                        uint64_t window_size) {
+    int in_fd = open(asset->file_path, O_RDONLY);
+    stats_io(0, 0);
+    if (in_fd < 0) {
+        fprintf(stderr, "can't open %s\n", asset->file_path);
+        exit(1);
     }
+    copy_file_content(out, out_offset, in_fd, 0, asset->file_size,
+                      window_size, asset->file_path);
+    close(in_fd);
+}
+
+typedef struct {
+    Output *out;
+    uint64_t offset; // of the pack in the output
+    Pack *pack;
+    uint64_t window_size;
+} PackWriteCtx;
+
+void write_pack_file_task(void *ctx, uint32_t index) {
+    PackWriteCtx *c = ctx;
+    PackFile *file = &c->pack->files[index];
+    if (file->size == 0) {
+        return;
+    }
+    int in_fd = open(file->path, O_RDONLY);
+    stats_io(0, 0);
+    if (in_fd < 0) {
+        fprintf(stderr, "can't open %s\n", file->path);
+        exit(1);
+    }
+    copy_file_content(c->out, c->offset + file->offset, in_fd, 0, file->size,
+                      c->window_size, file->path);
+    close(in_fd);
+}
+
+// Places the blob of pack at offset of the output: the index from memory,
+// files straight from disk on jobs threads.
+void write_pack(Output *out, uint64_t offset, Pack *pack,
+                uint64_t window_size, uint32_t jobs) {
+    output_write(out, offset, pack->index, pack->index_size);
+    PackWriteCtx ctx = {
+        .out = out,
+        .offset = offset,
+        .pack = pack,
+        .window_size = window_size,
+    };
+    parallel_for(.threads_count = jobs, .count = pack->count,
+                 .fn = write_pack_file_task, .ctx = &ctx);
+}
+
+typedef struct {
+    uint64_t size;
+    uint32_t index;
+} SizeIndex;
 
-    fflush(out_object_file);
-    fclose(out_object_file);
+int compare_size_index_desc(const void *a, const void *b) {
+    uint64_t size_a = ((const SizeIndex *)a)->size;
+    uint64_t size_b = ((const SizeIndex *)b)->size;
+    if (size_a != size_b) {
+        return size_a < size_b ? 1 : -1;
+    }
+    return ((const SizeIndex *)a)->index - ((const SizeIndex *)b)->index;
+}
+
+// Indices of assets from the biggest to the smallest.
+uint32_t *largest_first_order(Asset *assets, uint32_t assets_count) {
+    SizeIndex *sizes = calloc(assets_count, sizeof(SizeIndex));
+    for (uint32_t i = 0; i < assets_count; i++) {
+        sizes[i] = (SizeIndex){.size = assets[i].file_size, .index = i};
+    }
+    qsort(sizes, assets_count, sizeof(SizeIndex), compare_size_index_desc);
+    uint32_t *order = calloc(assets_count, sizeof(uint32_t));
+    for (uint32_t i = 0; i < assets_count; i++) {
+        order[i] = sizes[i].index;
+    }
+    free(sizes);
+    return order;
+}
+
+// Indices of assets from the most to the least aligned, in config order
+// within the same alignment, so padding is only needed where alignment
+// changes.
+uint32_t *most_aligned_first_order(Asset *assets, uint32_t assets_count) {
+    SizeIndex *alignments = calloc(assets_count, sizeof(SizeIndex));
+    for (uint32_t i = 0; i < assets_count; i++) {
+        alignments[i] = (SizeIndex){.size = assets[i].alignment, .index = i};
+    }
+    qsort(alignments, assets_count, sizeof(SizeIndex),
+          compare_size_index_desc);
+    uint32_t *order = calloc(assets_count, sizeof(uint32_t));
+    for (uint32_t i = 0; i < assets_count; i++) {
+        order[i] = alignments[i].index;
+    }
+    free(alignments);
+    return order;
+}
+
+bool is_compressed(Asset *asset) {
+    return asset->type == 'z' || asset->type == 'Z';
+}
+
+// Compressed asset content: decompressed size, compressed size and an LZ4
+// block, as read by crp_decompress() from runtime/crp.h.
+#define COMPRESSED_HEADER_SIZE (2 * sizeof(uint64_t))
+
+void compress_asset_task(void *ctx, uint32_t index) {
+    Asset *asset = &((Asset *)ctx)[index];
+    if (!is_compressed(asset) || asset->same_as != index) {
+        return;
+    }
+    const uint64_t start = stats_now();
+    int in_fd = open(asset->file_path, O_RDONLY);
+    stats_io(0, 0);
+    if (in_fd < 0) {
+        fprintf(stderr, "can't open %s\n", asset->file_path);
+        exit(1);
+    }
+    uint8_t *in = malloc(asset->file_size ? asset->file_size : 1);
+    read_asset_content(in, in_fd, asset);
+    close(in_fd);
+
+    uint8_t *out = malloc(COMPRESSED_HEADER_SIZE +
+                          lz4_compress_bound(asset->file_size));
+    uint64_t compressed_size =
+        asset->type == 'Z'
+            ? lz4_compress_high(in, asset->file_size,
+                                out + COMPRESSED_HEADER_SIZE)
+            : lz4_compress(in, asset->file_size, out + COMPRESSED_HEADER_SIZE);
+    free(in);
+    memcpy(out, &asset->file_size, sizeof(uint64_t));
+    memcpy(out + sizeof(uint64_t), &compressed_size, sizeof(uint64_t));
+
+    asset->size = COMPRESSED_HEADER_SIZE + compressed_size;
+    asset->len = asset->file_size;
+    asset->content = realloc(out, asset->size);
+    stats_asset("compress", index, start);
+}
+
+// Compressed contents wait for the write pass in a file next to the output,
+// unlinked as soon as it's open, at spill_offset of their assets.
+typedef struct {
+    int fd; // -1 if nothing is compressed
+    uint64_t size;
+} Spill;
+
+int open_spill(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    stats_io(0, 0);
+    if (fd >= 0) {
+        unlink(path);
+        stats_io(0, 0);
+        return fd;
+    }
+    // next to outputs like /dev/null
+    FILE *file = tmpfile();
+    fd = file ? dup(fileno(file)) : -1;
+    if (file) {
+        fclose(file);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "can't open %s\n", path);
+        exit(1);
+    }
+    return fd;
+}
+
+// Compresses 'z' and 'Z' assets on jobs threads, biggest first, in batches
+// whose input and output buffers fit in max_memory (a bigger asset makes a
+// batch of its own), and parks every batch in the spill file at spill_path.
+void compress_assets(Asset *assets, uint32_t assets_count, uint32_t jobs,
+                     uint64_t max_memory, const char *spill_path,
+                     Spill *spill) {
+    uint32_t *order = largest_first_order(assets, assets_count);
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < assets_count; i++) {
+        if (is_compressed(&assets[order[i]]) &&
+            assets[order[i]].same_as == order[i]) {
+            order[count++] = order[i];
+        }
+    }
+    if (count > 0) {
+        spill->fd = open_spill(spill_path);
+    }
+    for (uint32_t start = 0, end; start < count; start = end) {
+        uint64_t batch_size = 0;
+        for (end = start; end < count; end++) {
+            const uint64_t file_size = assets[order[end]].file_size;
+            const uint64_t needed = file_size + COMPRESSED_HEADER_SIZE +
+                                    lz4_compress_bound(file_size);
+            if (end > start && batch_size + needed > max_memory) {
+                break;
+            }
+            batch_size += needed;
+        }
+        parallel_for(.threads_count = jobs, .count = end - start,
+                     .order = order + start, .fn = compress_asset_task,
+                     .ctx = assets);
+        for (uint32_t i = start; i < end; i++) {
+            Asset *asset = &assets[order[i]];
+            pwrite_all(spill->fd, asset->content, asset->size, spill->size);
+            asset->spill_offset = spill->size;
+            spill->size += asset->size;
+            free(asset->content);
+            asset->content = NULL;
+        }
+    }
+    free(order);
+}
+
+typedef struct {
+    Asset *assets;
+    Output *out;
+    Section *sections;
+    uint64_t window_size;
+    SizesMode sizes;
+    const uint32_t *ids;
+    int spill_fd;
+} CopyAssetsCtx;
+
+void copy_asset_task(void *ctx, uint32_t index) {
+    CopyAssetsCtx *c = ctx;
+    Asset *asset = &c->assets[index];
+    if (c->sizes == SIZES_TABLE) {
+        output_write(c->out,
+                     c->sections[SIZE_TABLE_SECTION].file_offset +
+                         index * sizeof(asset->len),
+                     &asset->len, sizeof(asset->len));
+    }
+    if (asset->same_as != index) {
+        return; // written by the asset it shares bytes and size with
+    }
+    const uint64_t data_offset = c->sections[asset->section].file_offset;
+    if (c->sizes == SIZES_INLINE) {
+        output_write(c->out, data_offset + asset->size_offset, &asset->len,
+                     sizeof(asset->len));
+    }
+    if (asset->suffix_of != index || asset->pack) {
+        // bytes are written with the string it's the tail of, packs after
+        // the rest
+        return;
+    }
+    const uint64_t start = stats_now();
+    if (asset->content) {
+        output_write(c->out, data_offset + asset->offset, asset->content,
+                     asset->size);
+        free(asset->content);
+        asset->content = NULL;
+    } else if (is_compressed(asset)) {
+        copy_file_content(c->out, data_offset + asset->offset, c->spill_fd,
+                          asset->spill_offset, asset->size, c->window_size,
+                          asset->file_path);
+    } else if (asset->file_size > 0) {
+        copy_asset_content(c->out, data_offset + asset->offset, asset,
+                           c->window_size);
+    }
+    if (asset->type == 's') {
+        const uint8_t zero = 0;
+        output_write(c->out, data_offset + asset->offset + asset->file_size,
+                     &zero, 1);
+    }
+    stats_asset("copy", c->ids ? c->ids[index] : index, start);
+}
+
+// Writes contents of sections of the laid out object. Every byte has a
+// precomputed offset, so assets are copied on jobs threads, biggest first,
+// and output doesn't depend on the order they finish in. Padding isn't
+// written, the output is reserved in advance and reads as zeros there. ids
+// are indices of assets in stats, NULL if they are the same. Compressed
+// contents are copied from spill_fd. Files of packs are copied on jobs
+// threads a pack at a time, a single pack can be most of the output.
+void write_assets_content(Output *out, Object *object, Asset *assets,
+                          uint32_t assets_count, const uint32_t *ids,
+                          uint64_t window_size, SizesMode sizes, int spill_fd,
+                          uint32_t jobs) {
+    CopyAssetsCtx ctx = {
+        .assets = assets,
+        .out = out,
+        .sections = object->sections,
+        .window_size = window_size,
+        .sizes = sizes,
+        .ids = ids,
+        .spill_fd = spill_fd,
+    };
+
+    uint32_t *order = largest_first_order(assets, assets_count);
+    parallel_for(.threads_count = jobs, .count = assets_count, .order = order,
+                 .fn = copy_asset_task, .ctx = &ctx);
+    free(order);
+    for (uint32_t i = 0; i < assets_count; i++) {
+        Asset *asset = &assets[i];
+        if (asset->pack && asset->same_as == i) {
+            const uint64_t start = stats_now();
+            write_pack(out,
+                       object->sections[asset->section].file_offset +
+                           asset->offset,
+                       asset->pack, window_size, jobs);
+            stats_asset("copy", ids ? ids[i] : i, start);
+        }
+    }
+}
+
+typedef struct {
+    sds output_file;
+    sds config_file;
+    bool quiet;
+    Target target;
+    uint64_t max_memory;
+    bool page_align;
+    uint32_t jobs;
+    bool map_output;
+    bool cache;
+    sds depfile;
+    SizesMode sizes;
+    bool directory;
+    sds header;
+    bool asset_sections;
+    bool archive; // output ends with .a
+    bool stats;
+    sds stats_json;
+    sds trace;
+} Settings;
+
+Target parse_target(const char *name) {
+    for (int i = 0; i < TARGETS_COUNT; i++) {
+        if (strcmp(name, target_names[i]) == 0) {
+            return i;
+        }
+    }
+    fprintf(stderr, "unknown target: %s, expected one of:", name);
+    for (int i = 0; i < TARGETS_COUNT; i++) {
+        fprintf(stderr, " %s", target_names[i]);
+    }
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+Settings parse_args(int argc, char **argv) {
+    Settings settings = {
+        .config_file = sdsnew("crp.conf"),
+        .output_file = sdsnew("assets.o"),
+        .quiet = false,
+        .target = DEFAULT_TARGET,
+        .max_memory = 64 << 20,
+        .jobs = 1,
+    };
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            switch (argv[i][1]) {
+            case 'q':
+                settings.quiet = true;
+                break;
+            case 'c':
+                i++;
+                sdsfree(settings.config_file);
+                settings.config_file = sdsnew(argv[i]);
+                break;
+            case 'j':
+                i++;
+                settings.jobs = atoi(argv[i]) > 0 ? atoi(argv[i]) : 1;
+                break;
+            case 'M':
+                if (strcmp(argv[i], "-MD") == 0 && !settings.depfile) {
+                    settings.depfile = sdsempty(); // named after output below
+                }
+                break;
+            case '-':
+                if (strcmp(argv[i], "--target") == 0) {
+                    i++;
+                    settings.target = parse_target(argv[i]);
+                } else if (strcmp(argv[i], "--max-memory") == 0) {
+                    i++;
+                    settings.max_memory = parse_size(argv[i]);
+                } else if (strcmp(argv[i], "--page-align") == 0) {
+                    settings.page_align = true;
+                } else if (strcmp(argv[i], "--map-output") == 0) {
+                    settings.map_output = true;
+                } else if (strcmp(argv[i], "--cache") == 0) {
+                    settings.cache = true;
+                } else if (strcmp(argv[i], "--abs-sizes") == 0) {
+                    settings.sizes = SIZES_ABSOLUTE;
+                } else if (strcmp(argv[i], "--size-table") == 0) {
+                    settings.sizes = SIZES_TABLE;
+                } else if (strcmp(argv[i], "--directory") == 0) {
+                    settings.directory = true;
+                } else if (strcmp(argv[i], "--asset-sections") == 0) {
+                    settings.asset_sections = true;
+                } else if (strcmp(argv[i], "--stats") == 0) {
+                    settings.stats = true;
+                } else if (strcmp(argv[i], "--stats-json") == 0) {
+                    i++;
+                    sdsfree(settings.stats_json);
+                    settings.stats_json = sdsnew(argv[i]);
+                } else if (strcmp(argv[i], "--trace") == 0) {
+                    i++;
+                    sdsfree(settings.trace);
+                    settings.trace = sdsnew(argv[i]);
+                } else if (strcmp(argv[i], "--header") == 0) {
+                    i++;
+                    sdsfree(settings.header);
+                    settings.header = sdsnew(argv[i]);
+                } else if (strcmp(argv[i], "--depfile") == 0) {
+                    i++;
+                    sdsfree(settings.depfile);
+                    settings.depfile = sdsnew(argv[i]);
+                }
+                break;
+            }
+        } else {
+            sdsfree(settings.output_file);
+            settings.output_file = sdsnew(argv[i]);
+        }
+    }
+
+    const size_t output_length = sdslen(settings.output_file);
+    settings.archive = output_length > 2 &&
+                       strcmp(settings.output_file + output_length - 2,
+                              ".a") == 0;
+    if (settings.archive && (settings.sizes == SIZES_TABLE ||
+                             settings.directory)) {
+        fprintf(stderr, "--size-table and --directory reference every "
+                        "asset, they can't be used with archives\n");
+        exit(1);
+    }
+
+    // like cc -MD: assets.o -> assets.d
+    if (settings.depfile && sdslen(settings.depfile) == 0) {
+        sds depfile = sdsdup(settings.output_file);
+        char *dot = strrchr(depfile, '.');
+        if (dot && !strchr(dot, '/')) {
+            sdsrange(depfile, 0, dot - depfile - 1);
+        }
+        sdsfree(settings.depfile);
+        settings.depfile = sdscat(depfile, ".d");
+    }
+    return settings;
+}
+
+// Escapes path for a Make rule, ninja understands the same syntax.
+sds depfile_escape(sds out, const char *path) {
+    for (const char *c = path; *c; c++) {
+        if (*c == ' ' || *c == '#') {
+            out = sdscatlen(out, "\\", 1);
+        } else if (*c == '$') {
+            out = sdscatlen(out, "$", 1);
+        }
+        out = sdscatlen(out, c, 1);
+    }
+    return out;
+}
+
+// Make rule listing everything the output is built from, so build systems
+// rerun crp only when config or one of the assets changes. Directories
+// read for patterns and packs are listed too, for added and removed files.
+// Paths are listed once, sorted, after the config.
+void write_depfile(Settings *settings, Asset *assets, uint32_t assets_count,
+                   sds *dirs, uint32_t dirs_count) {
+    uint64_t paths_count = assets_count + dirs_count;
+    for (uint32_t i = 0; i < assets_count; i++) {
+        if (assets[i].pack) {
+            paths_count += assets[i].pack->count + assets[i].pack->dirs_count;
+        }
+    }
+    sds *paths = malloc((paths_count ? paths_count : 1) * sizeof(sds));
+    paths_count = 0;
+    for (uint32_t i = 0; i < assets_count; i++) {
+        paths[paths_count++] = assets[i].file_path;
+        for (uint32_t j = 0; assets[i].pack && j < assets[i].pack->count;
+             j++) {
+            paths[paths_count++] = assets[i].pack->files[j].path;
+        }
+        for (uint32_t j = 0; assets[i].pack && j < assets[i].pack->dirs_count;
+             j++) {
+            paths[paths_count++] = assets[i].pack->dirs[j];
+        }
+    }
+    memcpy(paths + paths_count, dirs, dirs_count * sizeof(sds));
+    paths_count += dirs_count;
+    qsort(paths, paths_count, sizeof(sds), compare_sds);
+
+    sds rule = depfile_escape(sdsempty(), settings->output_file);
+    rule = sdscat(rule, ": \\\n  ");
+    rule = depfile_escape(rule, settings->config_file);
+    for (uint64_t i = 0; i < paths_count; i++) {
+        if ((i > 0 && strcmp(paths[i], paths[i - 1]) == 0) ||
+            strcmp(paths[i], settings->config_file) == 0) {
+            continue;
+        }
+        rule = sdscat(rule, " \\\n  ");
+        rule = depfile_escape(rule, paths[i]);
+    }
+    free(paths);
+    rule = sdscat(rule, "\n");
+
+    FILE *file = fopen(settings->depfile, "w");
+    if (!file) {
+        fprintf(stderr, "can't write %s\n", settings->depfile);
+        exit(1);
+    }
+    stats_io(0, fwrite(rule, 1, sdslen(rule), file));
+    fclose(file);
+    sdsfree(rule);
+}
+
+// C++ declarations of assets with their real bounds, so the compiler knows
+// sizes: constexpr size constants and std::span / std::string_view
+// accessors in namespace crp. Needs C++20.
+sds header_source(Settings *settings, Asset *assets, uint32_t assets_count) {
+    sds source = sdscatfmt(sdsempty(),
+                           "#pragma once\n"
+                           "// Generated by crp from %S, do not edit.\n"
+                           "#include <cstddef>\n"
+                           "#include <cstdint>\n"
+                           "#include <span>\n"
+                           "#include <string_view>\n\n"
+                           "extern \"C\" {\n",
+                           settings->config_file);
+    for (uint32_t i = 0; i < assets_count; i++) {
+        Asset *asset = &assets[i];
+        if (asset->alignment > 0) {
+            source = sdscatfmt(source, "alignas(%U) ", asset->alignment);
+        }
+        source = sdscatfmt(source, "extern %sunsigned char %S[",
+                           asset->writable ? "" : "const ", asset->var_name);
+        if (asset->size > 0) { // zero length arrays aren't C++
+            source = sdscatfmt(source, "%U", asset->size);
+        }
+        source = sdscat(source, "];\n");
+    }
+    source = sdscat(source, "}\n\nnamespace crp {\n");
+
+    for (uint32_t i = 0; i < assets_count; i++) {
+        Asset *asset = &assets[i];
+        const char *constness = asset->writable ? "" : "const ";
+        source = sdscatfmt(source,
+                           "\n// %S\n"
+                           "inline constexpr std::uint64_t %S = %U;\n"
+                           "inline std::span<%sstd::byte, %U> %S() {\n",
+                           asset->file_path, asset->var_size_name, asset->len,
+                           constness, asset->size, asset->var_name);
+        if (asset->size > 0) {
+            source = sdscatfmt(source,
+                               "    return std::as_%sbytes(std::span(::%S));\n",
+                               asset->writable ? "writable_" : "",
+                               asset->var_name);
+        } else {
+            source = sdscat(source, "    return {};\n");
+        }
+        source = sdscat(source, "}\n");
+        if (asset->type == 's') { // without the 0 at the end
+            source = sdscatfmt(source,
+                               "inline std::string_view %S_str() {\n"
+                               "    return {reinterpret_cast<const char *>"
+                               "(::%S), %U};\n"
+                               "}\n",
+                               asset->var_name, asset->var_name,
+                               asset->len - 1);
+        }
+    }
+    return sdscat(source, "\n} // namespace crp\n");
+}
+
+// Rewrites the header only when it changes, so sources including it aren't
+// recompiled for nothing.
+void write_header(Settings *settings, Asset *assets, uint32_t assets_count) {
+    sds source = header_source(settings, assets, assets_count);
+    uint64_t size = 0;
+    uint8_t *current = NULL;
+    if (access(settings->header, R_OK) == 0) {
+        current = fread_all(.file_path = settings->header,
+                            .out_file_size = &size);
+    }
+    if (!current || size != sdslen(source) ||
+        memcmp(current, source, size) != 0) {
+        FILE *file = fopen(settings->header, "w");
+        if (!file) {
+            fprintf(stderr, "can't write %s\n", settings->header);
+            exit(1);
+        }
+        stats_io(0, fwrite(source, 1, sdslen(source), file));
+        fclose(file);
+    }
+    free(current);
+    sdsfree(source);
+}
+
+// Incremental build cache: a manifest next to the output ("<output>.cache")
+// records what the output was built from. Output is a function of config,
+// output affecting settings and contents of assets, so when all of them
+// match the manifest, the output is left untouched. Assets whose size, mtime
+// and inode match the manifest are trusted without hashing.
+
+// Seeds the key: bump it when the object of an unchanged config changes.
+#define CACHE_VERSION 7
+
+typedef struct {
+    uint64_t key;
+    FileStat output;
+    uint32_t assets_count;
+    Asset *assets; // file_path, file_size, mtime, inode and hash only
+} Cache;
+
+// Hash of everything except asset contents the output depends on.
+uint64_t cache_key(Settings *settings) {
+    uint64_t config_size;
+    uint8_t *config = fread_all(.file_path = settings->config_file,
+                                .out_file_size = &config_size);
+    Hasher h = hasher_new(CACHE_VERSION);
+    hasher_update(&h, config, config_size);
+    hasher_update(&h, &settings->target, sizeof(settings->target));
+    hasher_update(&h, &settings->page_align, sizeof(settings->page_align));
+    hasher_update(&h, &settings->sizes, sizeof(settings->sizes));
+    hasher_update(&h, &settings->directory, sizeof(settings->directory));
+    hasher_update(&h, &settings->asset_sections,
+                  sizeof(settings->asset_sections));
+    free(config);
+    return hasher_digest(&h);
+}
+
+bool read_cache(sds cache_path, Cache *cache) {
+    if (access(cache_path, R_OK) != 0) {
+        return false;
+    }
+    uint64_t size;
+    uint8_t *content = fread_all(.file_path = cache_path,
+                                 .add_zero_at_the_end = true,
+                                 .out_file_size = &size);
+    int lines_count;
+    sds *lines =
+        sdssplitlen((const char *)content, size - 1, "\n", 1, &lines_count);
+    free(content);
+
+    bool ok = lines_count >= 3;
+    uint32_t version = 0;
+    if (ok) {
+        ok = sscanf(lines[0], "crp-cache %u", &version) == 1 &&
+             version == CACHE_VERSION &&
+             sscanf(lines[1], "key %" SCNx64, &cache->key) == 1 &&
+             sscanf(lines[2], "output %" SCNu64 " %" SCNd64 " %" SCNu64,
+                    &cache->output.size, &cache->output.mtime,
+                    &cache->output.inode) == 3;
+    }
+    cache->assets = calloc(lines_count, sizeof(Asset));
+    cache->assets_count = 0;
+    for (int i = 3; ok && i < lines_count; i++) {
+        if (sdslen(lines[i]) == 0) {
+            continue;
+        }
+        Asset *asset = &cache->assets[cache->assets_count++];
+        int path_pos = 0;
+        ok = sscanf(lines[i],
+                    "asset %" SCNu64 " %" SCNd64 " %" SCNu64 " %" SCNx64 " %n",
+                    &asset->file_size, &asset->mtime, &asset->inode,
+                    &asset->hash, &path_pos) == 4 &&
+             path_pos > 0;
+        if (ok) {
+            asset->file_path = sdsnew(lines[i] + path_pos);
+        }
+    }
+    sdsfreesplitres(lines, lines_count);
+    return ok;
+}
+
+// Written to a temporary file and renamed, so the manifest is either old or
+// new, never partial.
+void write_cache(sds cache_path, uint64_t key, FileStat output,
+                 Asset *assets, uint32_t assets_count) {
+    sds tmp_path = sdscatfmt(sdsdup(cache_path), ".tmp");
+    FILE *file = fopen(tmp_path, "w");
+    if (!file) {
+        fprintf(stderr, "can't write %s\n", tmp_path);
+        exit(1);
+    }
+    fprintf(file, "crp-cache %u\n", CACHE_VERSION);
+    fprintf(file, "key %016" PRIx64 "\n", key);
+    fprintf(file, "output %" PRIu64 " %" PRId64 " %" PRIu64 "\n", output.size,
+            output.mtime, output.inode);
+    for (uint32_t i = 0; i < assets_count; i++) {
+        fprintf(file, "asset %" PRIu64 " %" PRId64 " %" PRIu64 " %016" PRIx64
+                      " %s\n",
+                assets[i].file_size, assets[i].mtime, assets[i].inode,
+                assets[i].hash, assets[i].file_path);
+    }
+    stats_io(0, ftell(file));
+    fclose(file);
+    rename(tmp_path, cache_path);
+    sdsfree(tmp_path);
+}
+
+bool same_file_stat(FileStat a, FileStat b) {
+    return a.size == b.size && a.mtime == b.mtime && a.inode == b.inode;
+}
+
+// Feeds the file at path to h through buf.
+void hash_file(Hasher *h, const char *path, uint8_t *buf, uint64_t buf_size) {
+    int fd = open(path, O_RDONLY);
+    stats_io(0, 0);
+    if (fd < 0) {
+        fprintf(stderr, "can't open %s\n", path);
+        exit(1);
+    }
+    ssize_t count;
+    while ((count = read(fd, buf, buf_size)) > 0) {
+        stats_io(count, 0);
+        hasher_update(h, buf, count);
+    }
+    close(fd);
+}
+
+void hash_asset_task(void *ctx, uint32_t index) {
+    Asset *asset = &((Asset *)ctx)[index];
+    if (asset->hash != 0) {
+        return; // taken from the cache
+    }
+    const uint64_t start = stats_now();
+    const uint64_t buf_size = 1 << 20;
+    uint8_t *buf = malloc(buf_size);
+    Hasher h = hasher_new(0);
+    if (asset->pack) {
+        // bytes of the blob: the index, then files in pack order
+        hasher_update(&h, asset->pack->index, asset->pack->index_size);
+        for (uint32_t i = 0; i < asset->pack->count; i++) {
+            hash_file(&h, asset->pack->files[i].path, buf, buf_size);
+        }
+    } else {
+        hash_file(&h, asset->file_path, buf, buf_size);
+    }
+    free(buf);
+    // 0 means "not hashed yet"
+    asset->hash = hasher_digest(&h) | 1;
+    stats_asset("hash", index, start);
+}
+
+// Fills hashes of assets, reusing ones from the cache for unchanged files.
+// Returns true if the output built from assets is the one in the cache.
+bool output_up_to_date(Settings *settings, sds cache_path, uint64_t key,
+                       Asset *assets, uint32_t assets_count) {
+    Cache cache = {};
+    FileStat output;
+    bool valid = read_cache(cache_path, &cache) && cache.key == key &&
+                 cache.assets_count == assets_count &&
+                 try_stat_file(settings->output_file, &output) &&
+                 same_file_stat(output, cache.output);
+
+    bool unchanged = valid;
+    for (uint32_t i = 0; valid && i < assets_count; i++) {
+        Asset *cached = &cache.assets[i];
+        if (sdscmp(cached->file_path, assets[i].file_path) != 0) {
+            unchanged = valid = false;
+            break;
+        }
+        FileStat cached_stat = {
+            .size = cached->file_size,
+            .mtime = cached->mtime,
+            .inode = cached->inode,
+        };
+        FileStat current = {
+            .size = assets[i].file_size,
+            .mtime = assets[i].mtime,
+            .inode = assets[i].inode,
+        };
+        if (same_file_stat(cached_stat, current)) {
+            assets[i].hash = cached->hash;
+        } else {
+            unchanged = false;
+        }
+    }
+    if (unchanged) {
+        return true;
+    }
+
+    parallel_for(.threads_count = settings->jobs, .count = assets_count,
+                  .fn = hash_asset_task, .ctx = assets);
+    if (!valid) {
+        return false;
+    }
+    for (uint32_t i = 0; i < assets_count; i++) {
+        if (assets[i].file_size != cache.assets[i].file_size ||
+            assets[i].hash != cache.assets[i].hash) {
+            return false;
+        }
+    }
+    // files were touched but bytes are the same, only refresh the manifest
+    write_cache(cache_path, key, output, assets, assets_count);
+    return true;
+}
+
+// Deduplication: read-only assets of the same type with the same bytes
+// share their content and size in the output. Files with the same device,
+// inode and mtime are the same file (hard links or listed twice) and aren't
+// hashed, the rest is hashed only when another asset has the same type and
+// size. Packs are always hashed, their inode is made up. Equal 64-bit
+// hashes are confirmed by comparing bytes.
+
+typedef struct {
+    char type;
+    uint64_t file_size;
+    uint64_t hash;
+    uint64_t device;
+    uint64_t inode;
+    int64_t mtime;
+    uint32_t index;
+} DedupKey;
+
+int compare_dedup_key(const void *a, const void *b) {
+    const DedupKey *x = a;
+    const DedupKey *y = b;
+    if (x->type != y->type) {
+        return x->type < y->type ? -1 : 1;
+    }
+    if (x->file_size != y->file_size) {
+        return x->file_size < y->file_size ? -1 : 1;
+    }
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    if (x->device != y->device) {
+        return x->device < y->device ? -1 : 1;
+    }
+    if (x->inode != y->inode) {
+        return x->inode < y->inode ? -1 : 1;
+    }
+    if (x->mtime != y->mtime) {
+        return x->mtime < y->mtime ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+bool same_dedup_content(DedupKey *a, DedupKey *b) {
+    return a->type == b->type && a->file_size == b->file_size &&
+           a->hash == b->hash;
+}
+
+int compare_dedup_index(const void *a, const void *b) {
+    const DedupKey *x = a;
+    const DedupKey *y = b;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Compares size bytes at offset_a of file at path_a with those at offset_b
+// of file at path_b, a buffer at a time.
+bool same_file_bytes(const char *path_a, uint64_t offset_a,
+                     const char *path_b, uint64_t offset_b, uint64_t size) {
+    int fd_a = open(path_a, O_RDONLY);
+    int fd_b = open(path_b, O_RDONLY);
+    stats_io(0, 0);
+    stats_io(0, 0);
+    if (fd_a < 0 || fd_b < 0) {
+        fprintf(stderr, "can't open %s\n", fd_a < 0 ? path_a : path_b);
+        exit(1);
+    }
+    const uint64_t buf_size = 1 << 20;
+    uint8_t *buf_a = malloc(size < buf_size ? size + 1 : buf_size);
+    uint8_t *buf_b = malloc(size < buf_size ? size + 1 : buf_size);
+    bool same = true;
+    for (uint64_t done = 0; same && done < size;) {
+        const uint64_t chunk = size - done < buf_size ? size - done : buf_size;
+        read_file_content(buf_a, fd_a, offset_a + done, chunk, path_a);
+        read_file_content(buf_b, fd_b, offset_b + done, chunk, path_b);
+        same = memcmp(buf_a, buf_b, chunk) == 0;
+        done += chunk;
+    }
+    free(buf_a);
+    free(buf_b);
+    close(fd_a);
+    close(fd_b);
+    return same;
+}
+
+// Compares bytes of two assets with the same type, size and hash. Packs
+// with the same index have files of the same sizes at the same offsets.
+bool same_asset_bytes(Asset *a, Asset *b) {
+    if (a->content && b->content) {
+        return memcmp(a->content, b->content, a->size) == 0;
+    }
+    if (a->pack) {
+        if (a->pack->index_size != b->pack->index_size ||
+            memcmp(a->pack->index, b->pack->index, a->pack->index_size) != 0) {
+            return false;
+        }
+        for (uint32_t i = 0; i < a->pack->count; i++) {
+            if (!same_file_bytes(a->pack->files[i].path, 0,
+                                 b->pack->files[i].path, 0,
+                                 a->pack->files[i].size)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    return same_file_bytes(a->file_path, 0, b->file_path, 0, a->file_size);
+}
+
+// Sets same_as of duplicates to the first asset with the same bytes, so the
+// output doesn't depend on the order of hashing. Returns number of
+// duplicates.
+uint32_t dedup_assets(Asset *assets, uint32_t assets_count, uint32_t jobs) {
+    DedupKey *keys = calloc(assets_count ? assets_count : 1, sizeof(DedupKey));
+    uint32_t keys_count = 0;
+    for (uint32_t i = 0; i < assets_count; i++) {
+        if (!assets[i].writable) {
+            keys[keys_count++] = (DedupKey){
+                .type = assets[i].type,
+                .file_size = assets[i].file_size,
+                .device = assets[i].device,
+                .inode = assets[i].inode,
+                .mtime = assets[i].mtime,
+                .index = i,
+            };
+        }
+    }
+
+    // hash is 0 for now, so runs of equal type and size are sorted by file
+    // and then by index
+    qsort(keys, keys_count, sizeof(DedupKey), compare_dedup_key);
+    uint32_t *to_hash = calloc(keys_count ? keys_count : 1, sizeof(uint32_t));
+    uint32_t to_hash_count = 0;
+    uint32_t unique_count = 0;
+    for (uint32_t i = 0; i < keys_count; i++) {
+        DedupKey *key = &keys[i];
+        if (i > 0 && same_dedup_content(key, &keys[i - 1]) &&
+            !assets[key->index].pack && key->device == keys[i - 1].device &&
+            key->inode == keys[i - 1].inode &&
+            key->mtime == keys[i - 1].mtime) {
+            assets[key->index].same_as = assets[keys[i - 1].index].same_as;
+            continue;
+        }
+        bool alone =
+            !(i > 0 && same_dedup_content(key, &keys[i - 1])) &&
+            !(i + 1 < keys_count && same_dedup_content(key, &keys[i + 1]));
+        if (!alone && assets[key->index].hash == 0) {
+            to_hash[to_hash_count++] = key->index;
+        }
+        keys[unique_count++] = *key;
+    }
+    parallel_for(.threads_count = jobs, .count = to_hash_count,
+                 .order = to_hash, .fn = hash_asset_task, .ctx = assets);
+    free(to_hash);
+
+    for (uint32_t i = 0; i < unique_count; i++) {
+        keys[i].hash = assets[keys[i].index].hash;
+    }
+    qsort(keys, unique_count, sizeof(DedupKey), compare_dedup_key);
+    for (uint32_t start = 0, end; start < unique_count; start = end) {
+        for (end = start + 1;
+             end < unique_count && same_dedup_content(&keys[end], &keys[start]);
+             end++) {
+        }
+        // the first asset with the same bytes, those of a hash collision
+        // are moved to the front of the run and start a group of their own
+        qsort(keys + start, end - start, sizeof(DedupKey),
+              compare_dedup_index);
+        uint32_t firsts = start;
+        for (uint32_t i = start; i < end; i++) {
+            Asset *asset = &assets[keys[i].index];
+            uint32_t k = start;
+            while (k < firsts &&
+                   !same_asset_bytes(&assets[keys[k].index], asset)) {
+                k++;
+            }
+            if (k == firsts) {
+                keys[firsts++] = keys[i];
+            }
+            asset->same_as = keys[k].index;
+        }
+    }
+    free(keys);
+
+    // files listed several times point to their first listing, which may
+    // have become a duplicate itself. Content is aligned for all of them.
+    uint32_t duplicates = 0;
+    for (uint32_t i = 0; i < assets_count; i++) {
+        assets[i].same_as = assets[assets[i].same_as].same_as;
+        duplicates += assets[i].same_as != i;
+        Asset *original = &assets[assets[i].same_as];
+        if (assets[i].alignment > original->alignment) {
+            original->alignment = assets[i].alignment;
+        }
+    }
+    return duplicates;
+}
+
+// Tail merging: like linkers merge strings, a read-only string which is
+// the tail of another one (terminating zero included) points into it and
+// only gets its own size. Only the last TAIL_SAMPLE_SIZE bytes of every
+// candidate are kept in memory; strings that end with the same sample are
+// told apart by reading further back through the files, a chunk at a time,
+// so memory doesn't depend on sizes of strings.
+
+#define TAIL_MERGE_MAX_SIZE (64 << 10) // bigger strings are left alone
+#define TAIL_SAMPLE_SIZE 64
+#define TAIL_CHUNK_SIZE 4096
+
+// tails can't keep an alignment of their own
+bool is_tail_merge_candidate(Asset *asset, uint32_t index) {
+    return asset->type == 's' && !asset->writable && asset->alignment == 0 &&
+           asset->same_as == index && asset->size <= TAIL_MERGE_MAX_SIZE;
+}
+
+typedef struct {
+    uint8_t tail[TAIL_SAMPLE_SIZE]; // last bytes, terminating zero included
+    uint32_t tail_size;
+    uint64_t size;
+    uint32_t index;
+    sds file_path;
+} TailKey;
+
+typedef struct {
+    Asset *assets;
+    TailKey *keys;
+} TailReadCtx;
+
+void read_tail_task(void *ctx, uint32_t index) {
+    TailReadCtx *c = ctx;
+    TailKey *key = &c->keys[index];
+    Asset *asset = &c->assets[key->index];
+    const uint64_t start = stats_now();
+    key->tail_size =
+        asset->size < TAIL_SAMPLE_SIZE ? asset->size : TAIL_SAMPLE_SIZE;
+    const uint64_t from_file = key->tail_size - 1; // and the zero
+    if (from_file > 0) {
+        int in_fd = open(asset->file_path, O_RDONLY);
+        stats_io(0, 0);
+        if (in_fd < 0) {
+            fprintf(stderr, "can't open %s\n", asset->file_path);
+            exit(1);
+        }
+        read_file_content(key->tail, in_fd, asset->file_size - from_file,
+                          from_file, asset->file_path);
+        close(in_fd);
+    }
+    key->tail[from_file] = 0;
+    stats_asset("read", key->index, start);
+}
+
+// Compares length bytes before end_a of file at path_a with those before
+// end_b of file at path_b, from the last one back, like compare_tail_key.
+int compare_file_tails(const char *path_a, uint64_t end_a,
+                       const char *path_b, uint64_t end_b, uint64_t length) {
+    int fd_a = open(path_a, O_RDONLY);
+    int fd_b = open(path_b, O_RDONLY);
+    stats_io(0, 0);
+    stats_io(0, 0);
+    if (fd_a < 0 || fd_b < 0) {
+        fprintf(stderr, "can't open %s\n", fd_a < 0 ? path_a : path_b);
+        exit(1);
+    }
+    uint8_t buf_a[TAIL_CHUNK_SIZE];
+    uint8_t buf_b[TAIL_CHUNK_SIZE];
+    int order = 0;
+    for (uint64_t done = 0; order == 0 && done < length;) {
+        const uint64_t chunk = length - done < TAIL_CHUNK_SIZE
+                                   ? length - done
+                                   : TAIL_CHUNK_SIZE;
+        read_file_content(buf_a, fd_a, end_a - done - chunk, chunk, path_a);
+        read_file_content(buf_b, fd_b, end_b - done - chunk, chunk, path_b);
+        for (uint64_t i = chunk; order == 0 && i-- > 0;) {
+            if (buf_a[i] != buf_b[i]) {
+                order = buf_a[i] < buf_b[i] ? -1 : 1;
+            }
+        }
+        done += chunk;
+    }
+    close(fd_a);
+    close(fd_b);
+    return order;
+}
+
+// Orders strings by their reversed bytes, so a string is followed by
+// strings that end with it.
+int compare_tail_key(const void *a, const void *b) {
+    const TailKey *x = a;
+    const TailKey *y = b;
+    for (uint32_t i = 1; i <= x->tail_size && i <= y->tail_size; i++) {
+        if (x->tail[x->tail_size - i] != y->tail[y->tail_size - i]) {
+            return x->tail[x->tail_size - i] < y->tail[y->tail_size - i] ? -1
+                                                                         : 1;
+        }
+    }
+    // both longer than the sample, the rest is in the files, without the
+    // zeros
+    const uint64_t shorter = x->size < y->size ? x->size : y->size;
+    if (shorter > TAIL_SAMPLE_SIZE) {
+        const int order = compare_file_tails(
+            x->file_path, x->size - TAIL_SAMPLE_SIZE, y->file_path,
+            y->size - TAIL_SAMPLE_SIZE, shorter - TAIL_SAMPLE_SIZE);
+        if (order != 0) {
+            return order;
+        }
+    }
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Sets suffix_of of strings which are tails of other strings. Returns
+// number of merged strings.
+uint32_t tail_merge_strings(Asset *assets, uint32_t assets_count,
+                            uint32_t jobs) {
+    TailKey *keys = calloc(assets_count ? assets_count : 1, sizeof(TailKey));
+    uint32_t keys_count = 0;
+    for (uint32_t i = 0; i < assets_count; i++) {
+        if (is_tail_merge_candidate(&assets[i], i)) {
+            keys[keys_count++] = (TailKey){
+                .size = assets[i].size,
+                .index = i,
+                .file_path = assets[i].file_path,
+            };
+        }
+    }
+    TailReadCtx ctx = {.assets = assets, .keys = keys};
+    parallel_for(.threads_count = jobs, .count = keys_count,
+                 .fn = read_tail_task, .ctx = &ctx);
+    qsort(keys, keys_count, sizeof(TailKey), compare_tail_key);
+
+    // the next string in tail order ends with this one if any does, the
+    // string it is merged into is merged further the same way
+    uint32_t merged = 0;
+    for (uint32_t i = keys_count ? keys_count - 1 : 0; i-- > 0;) {
+        TailKey *key = &keys[i];
+        TailKey *next = &keys[i + 1];
+        Asset *asset = &assets[key->index];
+        Asset *longer = &assets[next->index];
+        if (next->size >= key->size &&
+            memcmp(next->tail + next->tail_size - key->tail_size, key->tail,
+                   key->tail_size) == 0 &&
+            (key->size <= TAIL_SAMPLE_SIZE ||
+             compare_file_tails(asset->file_path, asset->file_size,
+                                longer->file_path, longer->file_size,
+                                asset->file_size) == 0)) {
+            asset->suffix_of = longer->suffix_of;
+            merged++;
+        }
+    }
+    free(keys);
+    return merged;
+}
+
+// Asset directory: crp_directory of runtime/crp.h in a section of its own,
+// followed by entries in slot order, displacements and names. Pointers are
+// relocations, so the section is .data.rel.ro and read-only once loaded.
+// Slots come from a minimal perfect hash (hash and displace): names are
+// hashed into buckets of about 4, biggest buckets first try displacements
+// until all their names land in free slots, single names take whatever slot
+// is left. Paths listed several times get one entry, the first.
+
+#define DIRECTORY_BUCKET_SIZE 4
+#define DIRECTORY_MAX_DISPLACEMENT (1 << 20)
+
+typedef struct {
+    uint8_t *content;
+    uint64_t size;
+    Relocation *relocations;
+    uint32_t relocations_count;
+} Directory;
+
+typedef struct {
+    uint64_t hash;
+    uint32_t index; // asset
+    uint32_t bucket;
+} DirectoryKey;
+
+int compare_directory_key_bucket(const void *a, const void *b) {
+    const DirectoryKey *x = a;
+    const DirectoryKey *y = b;
+    if (x->bucket != y->bucket) {
+        return x->bucket < y->bucket ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+typedef struct {
+    uint32_t bucket;
+    uint32_t first; // key
+    uint32_t size;
+} DirectoryBucket;
+
+int compare_directory_bucket_size_desc(const void *a, const void *b) {
+    const DirectoryBucket *x = a;
+    const DirectoryBucket *y = b;
+    if (x->size != y->size) {
+        return x->size < y->size ? 1 : -1;
+    }
+    return x->bucket < y->bucket ? -1 : x->bucket > y->bucket;
+}
+
+typedef struct {
+    sds path;
+    uint32_t index;
+} PathIndex;
+
+int compare_path_index(const void *a, const void *b) {
+    const PathIndex *x = a;
+    const PathIndex *y = b;
+    int order = sdscmp(x->path, y->path);
+    return order ? order : (x->index < y->index ? -1 : x->index > y->index);
+}
+
+// Fills slots (asset index per slot) and displacements for seed, returns
+// false if some bucket can't be placed.
+bool place_directory(DirectoryKey *keys, uint32_t count,
+                     uint64_t buckets_count, uint32_t *displacements,
+                     uint32_t *slots) {
+    qsort(keys, count, sizeof(DirectoryKey), compare_directory_key_bucket);
+    DirectoryBucket *buckets = calloc(buckets_count, sizeof(DirectoryBucket));
+    for (uint32_t i = 0; i < buckets_count; i++) {
+        buckets[i].bucket = i;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        DirectoryBucket *bucket = &buckets[keys[i].bucket];
+        if (bucket->size++ == 0) {
+            bucket->first = i;
+        }
+    }
+    qsort(buckets, buckets_count, sizeof(DirectoryBucket),
+          compare_directory_bucket_size_desc);
+
+    bool *taken = calloc(count, sizeof(bool));
+    uint64_t *bucket_slots = calloc(count, sizeof(uint64_t));
+    uint32_t free_slot = 0;
+    bool placed = true;
+    for (uint32_t b = 0; placed && b < buckets_count; b++) {
+        DirectoryBucket *bucket = &buckets[b];
+        DirectoryKey *bucket_keys = &keys[bucket->first];
+        displacements[bucket->bucket] = 0;
+        if (bucket->size == 1) {
+            while (taken[free_slot]) {
+                free_slot++;
+            }
+            taken[free_slot] = true;
+            slots[free_slot] = bucket_keys[0].index;
+            displacements[bucket->bucket] = CRP_DIRECT_SLOT | free_slot;
+            continue;
+        }
+        uint32_t d;
+        for (d = 0; bucket->size > 0 && d < DIRECTORY_MAX_DISPLACEMENT; d++) {
+            uint32_t k;
+            for (k = 0; k < bucket->size; k++) {
+                bucket_slots[k] = crp_slot(bucket_keys[k].hash, d, count);
+                if (taken[bucket_slots[k]]) {
+                    break;
+                }
+                taken[bucket_slots[k]] = true;
+            }
+            if (k == bucket->size) {
+                break;
+            }
+            while (k-- > 0) {
+                taken[bucket_slots[k]] = false;
+            }
+        }
+        if (bucket->size > 0 && d == DIRECTORY_MAX_DISPLACEMENT) {
+            placed = false;
+            break;
+        }
+        displacements[bucket->bucket] = d;
+        for (uint32_t k = 0; k < bucket->size; k++) {
+            slots[bucket_slots[k]] = bucket_keys[k].index;
+        }
+    }
+    free(bucket_slots);
+    free(taken);
+    free(buckets);
+    return placed;
+}
+
+// Builds the directory for laid out assets, placed in section.
+Directory build_directory(Asset *assets, uint32_t assets_count,
+                          uint32_t section) {
+    // first listing of every path
+    PathIndex *by_path =
+        calloc(assets_count ? assets_count : 1, sizeof(PathIndex));
+    for (uint32_t i = 0; i < assets_count; i++) {
+        by_path[i] = (PathIndex){.path = assets[i].file_path, .index = i};
+    }
+    qsort(by_path, assets_count, sizeof(PathIndex), compare_path_index);
+    DirectoryKey *keys =
+        calloc(assets_count ? assets_count : 1, sizeof(DirectoryKey));
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < assets_count; i++) {
+        if (i > 0 && sdscmp(by_path[i].path, by_path[i - 1].path) == 0) {
+            continue;
+        }
+        keys[count++] = (DirectoryKey){.index = by_path[i].index};
+    }
+    free(by_path);
+
+    uint64_t buckets_count =
+        (count + DIRECTORY_BUCKET_SIZE - 1) / DIRECTORY_BUCKET_SIZE;
+    if (buckets_count == 0) {
+        buckets_count = 1;
+    }
+    uint32_t *displacements = calloc(buckets_count, sizeof(uint32_t));
+    uint32_t *slots = calloc(count ? count : 1, sizeof(uint32_t));
+    uint64_t seed = 0;
+    for (;; seed++) {
+        for (uint32_t i = 0; i < count; i++) {
+            keys[i].hash = crp_hash(assets[keys[i].index].file_path, seed);
+            keys[i].bucket = keys[i].hash % buckets_count;
+        }
+        if (place_directory(keys, count, buckets_count, displacements,
+                            slots)) {
+            break;
+        }
+    }
+    free(keys);
+
+    const uint64_t entries_offset = sizeof(crp_directory_t);
+    const uint64_t displacements_offset =
+        entries_offset + sizeof(crp_entry) * count;
+    const uint64_t names_offset =
+        displacements_offset + sizeof(uint32_t) * buckets_count;
+    uint64_t size = names_offset;
+    for (uint32_t i = 0; i < count; i++) {
+        size += sdslen(assets[slots[i]].file_path) + 1;
+    }
+
+    Directory directory = {
+        .content = calloc(size, 1),
+        .size = size,
+        .relocations = calloc(2 + count * 2, sizeof(Relocation)),
+    };
+    // pointers are zero in content, relocations set them
+    uint64_t header[3] = {count, buckets_count, seed};
+    memcpy(directory.content, header, sizeof(header));
+    directory.relocations[directory.relocations_count++] = (Relocation){
+        .section = section,
+        .offset = offsetof(crp_directory_t, entries),
+        .target_section = section,
+        .target_offset = entries_offset,
+    };
+    directory.relocations[directory.relocations_count++] = (Relocation){
+        .section = section,
+        .offset = offsetof(crp_directory_t, displacements),
+        .target_section = section,
+        .target_offset = displacements_offset,
+    };
+    memcpy(directory.content + displacements_offset, displacements,
+           sizeof(uint32_t) * buckets_count);
+
+    uint64_t name_offset = names_offset;
+    for (uint32_t i = 0; i < count; i++) {
+        Asset *asset = &assets[slots[i]];
+        const uint64_t entry_offset = entries_offset + sizeof(crp_entry) * i;
+        memcpy(directory.content + entry_offset + offsetof(crp_entry, size),
+               &asset->len, sizeof(asset->len));
+        directory.relocations[directory.relocations_count++] = (Relocation){
+            .section = section,
+            .offset = entry_offset + offsetof(crp_entry, name),
+            .target_section = section,
+            .target_offset = name_offset,
+        };
+        directory.relocations[directory.relocations_count++] = (Relocation){
+            .section = section,
+            .offset = entry_offset + offsetof(crp_entry, data),
+            .target_section = asset->section,
+            .target_offset = asset->offset,
+        };
+        memcpy(directory.content + name_offset, asset->file_path,
+               sdslen(asset->file_path) + 1);
+        name_offset += sdslen(asset->file_path) + 1;
+    }
+    free(slots);
+    free(displacements);
+    return directory;
+}
+
+// Sections with contents and sizes of assets and two symbols per asset.
+// SIZES_ABSOLUTE makes size symbols absolute, their value is the size,
+// SIZES_TABLE adds crp_sizes covering the whole table.
+Object assets_object(Target target, Asset *assets, uint32_t assets_count,
+                     Section *sections, uint32_t sections_count,
+                     SizesMode sizes, Arena *arena) {
+    Object object = {
+        .target = target,
+        .sections = sections,
+        .sections_count = sections_count,
+        // room for crp_sizes and crp_directory
+        .symbols = arena_alloc(arena, (assets_count * 2 + 2) * sizeof(Symbol),
+                               _Alignof(Symbol)),
+        .symbols_count = assets_count * 2,
+    };
+    for (uint32_t i = 0; i < assets_count; i++) {
+        const uint32_t original = assets[i].same_as;
+        object.symbols[i * 2] = (Symbol){
+            .name = assets[i].var_name,
+            .section = assets[i].section,
+            .value = assets[i].offset,
+            .size = assets[i].size,
+            .inside = assets[original].suffix_of != original,
+        };
+        if (sizes == SIZES_ABSOLUTE) {
+            object.symbols[i * 2 + 1] = (Symbol){
+                .name = assets[i].var_size_name,
+                .value = assets[i].len,
+                .absolute = true,
+            };
+        } else if (sizes == SIZES_TABLE) {
+            object.symbols[i * 2 + 1] = (Symbol){
+                .name = assets[i].var_size_name,
+                .section = SIZE_TABLE_SECTION,
+                .value = i * sizeof(assets[i].len),
+                .size = sizeof(assets[i].len),
+            };
+        } else {
+            object.symbols[i * 2 + 1] = (Symbol){
+                .name = assets[i].var_size_name,
+                .section = assets[i].section,
+                .value = assets[i].size_offset,
+                .size = sizeof(assets[i].len),
+            };
+        }
+    }
+    if (sizes == SIZES_TABLE) {
+        object.symbols[object.symbols_count++] = (Symbol){
+            .name = arena_sds(arena, "crp_sizes", strlen("crp_sizes")),
+            .section = SIZE_TABLE_SECTION,
+            .value = 0,
+            .size = sections[SIZE_TABLE_SECTION].size,
+        };
+    }
+    return object;
+}
+
+// Places sections and tables of the object in the file, returns its size.
+uint64_t layout_object(Object *object) {
+    switch (object->target) {
+    case TARGET_MACHO_ARM64:
+#ifdef CRP_HAS_MACHO
+        return layout_macho(object);
+#else
+        fprintf(stderr, "crp was built without Mach-O support\n");
+        exit(1);
+#endif
+    case TARGET_ELF_X86_64:
+    case TARGET_ELF_AARCH64:
+#ifdef CRP_HAS_ELF
+        return layout_elf(object);
+#else
+        fprintf(stderr, "crp was built without ELF support\n");
+        exit(1);
+#endif
+    default:
+        return 0;
+    }
+}
+
+void write_object(Object *object, Output *out, uint32_t jobs) {
+    switch (object->target) {
+#ifdef CRP_HAS_MACHO
+    case TARGET_MACHO_ARM64:
+        write_macho(object, out, jobs);
+        break;
+#endif
+#ifdef CRP_HAS_ELF
+    case TARGET_ELF_X86_64:
+    case TARGET_ELF_AARCH64:
+        write_elf(object, out, jobs);
+        break;
+#endif
+    default:
+        break;
+    }
+}
+
+// Archive output (<output>.a): an object per asset, so linkers only pull
+// assets something references. Tails of strings and duplicates go to the
+// member of the content they point into. The whole archive is written to
+// <output>.tmp every time, members of the previous one aren't reused: a
+// changed size moves every member after it, and the rename keeps the old
+// archive intact until the new one is complete.
+
+typedef struct {
+    Asset *assets; // same_as and suffix_of are indices in the member
+    uint32_t *ids;  // index in all assets of every asset of the member
+    uint32_t assets_count;
+    Object object;
+} AssetsMember;
+
+// Splits assets into members and lays out their objects. Sizes and offsets
+// are copied back to assets.
+AssetsMember *assets_members(Asset *assets, uint32_t assets_count,
+                             Target target, uint32_t alignment, uint32_t align,
+                             SizesMode sizes, Arena *arena,
+                             uint32_t *out_count) {
+    uint32_t *member_of = calloc(assets_count ? assets_count : 1,
+                                 sizeof(uint32_t)); // of originals only
+    uint32_t *local_index = calloc(assets_count ? assets_count : 1,
+                                   sizeof(uint32_t));
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < assets_count; i++) {
+        if (assets[i].same_as == i && assets[i].suffix_of == i) {
+            member_of[i] = count++;
+        }
+    }
+    AssetsMember *members = calloc(count ? count : 1, sizeof(AssetsMember));
+    // originals of duplicates may be tails of strings themselves
+    for (uint32_t i = 0; i < assets_count; i++) {
+        const uint32_t root = assets[assets[i].same_as].suffix_of;
+        members[member_of[root]].assets_count++;
+    }
+    Asset *member_assets = calloc(assets_count ? assets_count : 1,
+                                  sizeof(Asset));
+    uint32_t *ids = calloc(assets_count ? assets_count : 1, sizeof(uint32_t));
+    for (uint32_t m = 0, first = 0; m < count; m++) {
+        members[m].assets = member_assets + first;
+        members[m].ids = ids + first;
+        first += members[m].assets_count;
+        members[m].assets_count = 0;
+    }
+    for (uint32_t i = 0; i < assets_count; i++) {
+        AssetsMember *member =
+            &members[member_of[assets[assets[i].same_as].suffix_of]];
+        local_index[i] = member->assets_count;
+        member->ids[member->assets_count] = i;
+        member->assets[member->assets_count++] = assets[i];
+    }
+    for (uint32_t i = 0; i < assets_count; i++) {
+        AssetsMember *member =
+            &members[member_of[assets[assets[i].same_as].suffix_of]];
+        Asset *local = &member->assets[local_index[i]];
+        local->same_as = local_index[assets[i].same_as];
+        local->suffix_of = local_index[assets[i].suffix_of];
+    }
+
+    for (uint32_t m = 0; m < count; m++) {
+        AssetsMember *member = &members[m];
+        uint32_t sections_count;
+        Section *sections = assets_sections(
+            member->assets, member->assets_count, sizes, &sections_count);
+        uint32_t *order =
+            most_aligned_first_order(member->assets, member->assets_count);
+        layout_assets(member->assets, member->assets_count, order, sections,
+                      sections_count, alignment, align, sizes);
+        free(order);
+        member->object = assets_object(target, member->assets,
+                                       member->assets_count, sections,
+                                       sections_count, sizes, arena);
+        layout_object(&member->object);
+    }
+    for (uint32_t i = 0; i < assets_count; i++) {
+        Asset *local = &members[member_of[assets[assets[i].same_as].suffix_of]]
+                            .assets[local_index[i]];
+        assets[i].size = local->size;
+        assets[i].len = local->len;
+        assets[i].offset = local->offset;
+        assets[i].size_offset = local->size_offset;
+    }
+    free(member_of);
+    free(local_index);
+    *out_count = count;
+    return members;
+}
+
+typedef struct {
+    AssetsMember *members;
+    Archive *archive;
+    Output *out;
+    uint64_t window_size;
+    SizesMode sizes;
+    int spill_fd;
+} WriteMembersCtx;
+
+void write_member_task(void *ctx, uint32_t index) {
+    WriteMembersCtx *c = ctx;
+    AssetsMember *member = &c->members[index];
+    Output out = *c->out;
+    out.base = c->archive->members[index].data_offset;
+    write_object(&member->object, &out, 1);
+    write_assets_content(&out, &member->object, member->assets,
+                         member->assets_count, member->ids, c->window_size,
+                         c->sizes, c->spill_fd, 1);
+}
+
+// Writes members on jobs threads, one member per job, biggest first.
+void write_members(Archive *archive, AssetsMember *members, Output *out,
+                   uint64_t window_size, SizesMode sizes, int spill_fd,
+                   uint32_t jobs) {
+    WriteMembersCtx ctx = {
+        .members = members,
+        .archive = archive,
+        .out = out,
+        .window_size = window_size,
+        .sizes = sizes,
+        .spill_fd = spill_fd,
+    };
+    const uint32_t count = archive->members_count;
+    SizeIndex *sizes_order = calloc(count ? count : 1, sizeof(SizeIndex));
+    for (uint32_t i = 0; i < count; i++) {
+        sizes_order[i] =
+            (SizeIndex){.size = members[i].object.file_size, .index = i};
+    }
+    qsort(sizes_order, count, sizeof(SizeIndex), compare_size_index_desc);
+    uint32_t *order = calloc(count ? count : 1, sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        order[i] = sizes_order[i].index;
+    }
+    free(sizes_order);
+    parallel_for(.threads_count = jobs, .count = count, .order = order,
+                 .fn = write_member_task, .ctx = &ctx);
+    free(order);
+}
+
+// Run report: --stats prints phases, I/O and the largest and slowest
+// assets to stderr, --stats-json writes the same as JSON, --trace a Chrome
+// trace (chrome://tracing, Perfetto) with phases and every asset task on
+// the thread that ran it.
+
+#define STATS_TOP_ASSETS 10
+
+sds json_escape(sds out, const char *str) {
+    out = sdscatlen(out, "\"", 1);
+    for (const char *c = str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            out = sdscatlen(out, "\\", 1);
+            out = sdscatlen(out, c, 1);
+        } else if ((uint8_t)*c < 0x20) {
+            out = sdscatprintf(out, "\\u%04x", (uint8_t)*c);
+        } else {
+            out = sdscatlen(out, c, 1);
+        }
+    }
+    return sdscatlen(out, "\"", 1);
+}
+
+// Indices of up to STATS_TOP_ASSETS assets with the biggest non-zero
+// values, in top, returns how many.
+uint32_t stats_top_assets(const uint64_t *values, uint32_t assets_count,
+                          uint32_t *top) {
+    SizeIndex *sorted = calloc(assets_count ? assets_count : 1,
+                               sizeof(SizeIndex));
+    for (uint32_t i = 0; i < assets_count; i++) {
+        sorted[i] = (SizeIndex){.size = values[i], .index = i};
+    }
+    qsort(sorted, assets_count, sizeof(SizeIndex), compare_size_index_desc);
+    uint32_t count = 0;
+    for (; count < assets_count && count < STATS_TOP_ASSETS &&
+           sorted[count].size > 0;
+         count++) {
+        top[count] = sorted[count].index;
+    }
+    free(sorted);
+    return count;
+}
+
+void write_report_file(const char *path, sds content) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "can't write %s\n", path);
+        exit(1);
+    }
+    fwrite(content, 1, sdslen(content), file);
+    fclose(file);
+}
+
+sds trace_source(Asset *assets) {
+    sds out = sdsnew("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (uint64_t i = 0; i < stats.events_count; i++) {
+        StatsEvent *event = &stats.events[i];
+        const bool phase = event->asset == UINT32_MAX;
+        out = sdscatprintf(out,
+                           "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                           "\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                           i ? "," : "", event->name,
+                           phase ? "phase" : "asset", event->thread,
+                           event->start_ns / 1e3, event->duration_ns / 1e3);
+        if (!phase) {
+            Asset *asset = &assets[event->asset];
+            out = sdscat(out, ",\"args\":{\"asset\":");
+            out = json_escape(out, asset->var_name);
+            out = sdscat(out, ",\"path\":");
+            out = json_escape(out, asset->file_path);
+            out = sdscatprintf(out, ",\"size\":%" PRIu64 "}", asset->size);
+        }
+        out = sdscat(out, "}");
+    }
+    return sdscat(out, "\n]}\n");
+}
+
+void report_stats(Settings *settings, Asset *assets, uint32_t assets_count) {
+    stats_phase(NULL);
+    uint64_t wall_ns = 0;
+    uint64_t cpu_ns = 0;
+    for (uint32_t i = 0; i < stats.phases_count; i++) {
+        wall_ns += stats.phases[i].wall_ns;
+        cpu_ns += stats.phases[i].cpu_ns;
+    }
+    uint64_t *values = calloc(assets_count ? assets_count : 1,
+                              sizeof(uint64_t));
+    uint32_t largest[STATS_TOP_ASSETS];
+    for (uint32_t i = 0; i < assets_count; i++) {
+        values[i] = assets[i].size;
+    }
+    const uint32_t largest_count =
+        stats_top_assets(values, assets_count, largest);
+    uint32_t slowest[STATS_TOP_ASSETS];
+    for (uint32_t i = 0; i < assets_count; i++) {
+        values[i] = stats.asset_ns[i];
+    }
+    const uint32_t slowest_count =
+        stats_top_assets(values, assets_count, slowest);
+    const uint64_t peak_rss_kib = stats_peak_rss_kib();
+
+    if (settings->stats) {
+        fprintf(stderr, "%-16s %12s %12s\n", "phase", "wall ms", "cpu ms");
+        for (uint32_t i = 0; i < stats.phases_count; i++) {
+            fprintf(stderr, "%-16s %12.3f %12.3f\n", stats.phases[i].name,
+                    stats.phases[i].wall_ns / 1e6,
+                    stats.phases[i].cpu_ns / 1e6);
+        }
+        fprintf(stderr, "%-16s %12.3f %12.3f\n", "total", wall_ns / 1e6,
+                cpu_ns / 1e6);
+        fprintf(stderr,
+                "read %" PRIu64 " bytes, wrote %" PRIu64
+                " bytes, about %" PRIu64 " I/O syscalls, peak RSS %" PRIu64
+                " KiB\n",
+                stats.bytes_read, stats.bytes_written, stats.syscalls,
+                peak_rss_kib);
+        fprintf(stderr, "largest assets:\n");
+        for (uint32_t i = 0; i < largest_count; i++) {
+            Asset *asset = &assets[largest[i]];
+            fprintf(stderr, "%14" PRIu64 " bytes  %s (%s)\n", asset->size,
+                    asset->var_name, asset->file_path);
+        }
+        fprintf(stderr, "slowest assets:\n");
+        for (uint32_t i = 0; i < slowest_count; i++) {
+            Asset *asset = &assets[slowest[i]];
+            fprintf(stderr, "%14.3f ms     %s (%s)\n",
+                    stats.asset_ns[slowest[i]] / 1e6, asset->var_name,
+                    asset->file_path);
+        }
+    }
+
+    if (settings->stats_json) {
+        sds out = sdsnew("{\"phases\":[");
+        for (uint32_t i = 0; i < stats.phases_count; i++) {
+            out = sdscatprintf(out,
+                               "%s{\"name\":\"%s\",\"wall_ms\":%.3f,"
+                               "\"cpu_ms\":%.3f}",
+                               i ? "," : "", stats.phases[i].name,
+                               stats.phases[i].wall_ns / 1e6,
+                               stats.phases[i].cpu_ns / 1e6);
+        }
+        out = sdscatprintf(out,
+                           "],\"wall_ms\":%.3f,\"cpu_ms\":%.3f,"
+                           "\"bytes_read\":%" PRIu64
+                           ",\"bytes_written\":%" PRIu64
+                           ",\"syscalls\":%" PRIu64
+                           ",\"peak_rss_kib\":%" PRIu64 ",\"largest\":[",
+                           wall_ns / 1e6, cpu_ns / 1e6, stats.bytes_read,
+                           stats.bytes_written, stats.syscalls, peak_rss_kib);
+        for (uint32_t i = 0; i < largest_count; i++) {
+            Asset *asset = &assets[largest[i]];
+            out = sdscat(out, i ? ",{\"name\":" : "{\"name\":");
+            out = json_escape(out, asset->var_name);
+            out = sdscat(out, ",\"path\":");
+            out = json_escape(out, asset->file_path);
+            out = sdscatprintf(out, ",\"size\":%" PRIu64 "}", asset->size);
+        }
+        out = sdscat(out, "],\"slowest\":[");
+        for (uint32_t i = 0; i < slowest_count; i++) {
+            Asset *asset = &assets[slowest[i]];
+            out = sdscat(out, i ? ",{\"name\":" : "{\"name\":");
+            out = json_escape(out, asset->var_name);
+            out = sdscat(out, ",\"path\":");
+            out = json_escape(out, asset->file_path);
+            out = sdscatprintf(out, ",\"ms\":%.3f}",
+                               stats.asset_ns[slowest[i]] / 1e6);
+        }
+        out = sdscat(out, "]}\n");
+        write_report_file(settings->stats_json, out);
+        sdsfree(out);
+    }
+
+    if (settings->trace) {
+        sds out = trace_source(assets);
+        write_report_file(settings->trace, out);
+        sdsfree(out);
+    }
+    free(values);
+}
+
+int main(int argc, char **argv) {
+    uint32_t assets_count;
+
+    Settings settings = parse_args(argc, argv);
+    stats_start(settings.trace != NULL);
+    const bool report = settings.stats || settings.stats_json || settings.trace;
+    stats_phase("parse config");
+    Arena arena = {};
+    sds *dirs = NULL;
+    uint32_t dirs_count = 0;
+    Asset *assets = load_assets(settings.config_file, &arena, settings.jobs,
+                                &assets_count, &dirs, &dirs_count);
+    if (report) {
+        stats_track_assets(assets_count);
+    }
+
+    // written even if the output is up to date, ninja expects it after every
+    // run
+    if (settings.depfile) {
+        stats_phase("depfile");
+        write_depfile(&settings, assets, assets_count, dirs, dirs_count);
+    }
+
+    sds cache_path = sdscatfmt(sdsdup(settings.output_file), ".cache");
+    uint64_t key = 0;
+    if (settings.cache) {
+        stats_phase("cache check");
+        key = cache_key(&settings);
+        // the header is built along with the output
+        if (output_up_to_date(&settings, cache_path, key, assets,
+                              assets_count) &&
+            (!settings.header || access(settings.header, F_OK) == 0)) {
+            if (!settings.quiet) {
+                printf("%s is up to date\n", settings.output_file);
+            }
+            if (report) {
+                report_stats(&settings, assets, assets_count);
+            }
+            arena_free(&arena);
+            return 0;
+        }
+    }
+
+    // after the cache check, up to date outputs don't pay for hashing and
+    // compression
+    stats_phase("dedup");
+    uint32_t duplicates = dedup_assets(assets, assets_count, settings.jobs);
+    stats_phase("tail merge");
+    uint32_t merged = tail_merge_strings(assets, assets_count, settings.jobs);
+    stats_phase("compress");
+    sds spill_path = sdscatfmt(sdsdup(settings.output_file), ".spill");
+    Spill spill = {.fd = -1};
+    compress_assets(assets, assets_count, settings.jobs, settings.max_memory,
+                    spill_path, &spill);
+    sdsfree(spill_path);
+    stats_phase("layout");
+
+    const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    const uint32_t alignment = 1 << 2;
+    // page aligned contents (and data section) let the writer share blocks
+    // with the asset files instead of copying them
+    const uint32_t align =
+        settings.page_align ? __builtin_ctzll(page_size) : 2;
+    uint32_t sections_count = 0;
+    Section *sections = NULL;
+    uint32_t members_count = 0;
+    AssetsMember *members = NULL;
+    if (settings.archive) {
+        members = assets_members(assets, assets_count, settings.target,
+                                 alignment, align, settings.sizes, &arena,
+                                 &members_count);
+    } else {
+        // Mach-O allows only 255 sections, its linker strips unreferenced
+        // symbols of a section instead (MH_SUBSECTIONS_VIA_SYMBOLS)
+        sections =
+            settings.asset_sections && settings.target != TARGET_MACHO_ARM64
+                ? per_asset_sections(assets, assets_count, settings.sizes,
+                                     &arena, &sections_count)
+                : assets_sections(assets, assets_count, settings.sizes,
+                                  &sections_count);
+        // alignment classes are packed together, from the biggest
+        uint32_t *order = most_aligned_first_order(assets, assets_count);
+        layout_assets(assets, assets_count, order, sections, sections_count,
+                      alignment, align, settings.sizes);
+        free(order);
+    }
+
+    if (!settings.quiet) {
+        printf("assets count: %d\n", assets_count);
+        for (uint32_t i = 0; i < assets_count; i++) {
+            printf("%d:", i);
+            DUMP(assets[i], Asset);
+        }
+    }
+    if (!settings.quiet && duplicates > 0) {
+        uint64_t saved = 0;
+        for (uint32_t i = 0; i < assets_count; i++) {
+            if (assets[i].same_as != i) {
+                saved += assets[assets[i].same_as].size +
+                         (settings.sizes == SIZES_INLINE ? sizeof(uint64_t)
+                                                         : 0);
+            }
+        }
+        printf("deduplicated %u assets, %" PRIu64 " bytes saved\n", duplicates,
+               saved);
+    }
+    if (!settings.quiet && merged > 0) {
+        uint64_t saved = 0;
+        for (uint32_t i = 0; i < assets_count; i++) {
+            if (assets[i].same_as == i && assets[i].suffix_of != i) {
+                saved += assets[i].size;
+            }
+        }
+        printf("merged %u strings into others, %" PRIu64 " bytes saved\n",
+               merged, saved);
+    }
+
+    Directory directory = {};
+    if (settings.directory) {
+        directory = build_directory(assets, assets_count, sections_count);
+        sections = realloc(sections, (sections_count + 1) * sizeof(Section));
+        sections[sections_count++] = (Section){
+            .name = ".data.rel.ro.crp_directory",
+            .segname = "__DATA",
+            .sectname = "__const",
+            .size = directory.size,
+            .align = 3,
+            .writable = true, // until relocated
+        };
+    }
+
+    Object object = {};
+    Archive archive = {};
+    uint64_t file_size;
+    if (settings.archive) {
+        archive = (Archive){
+            .target = settings.target,
+            .members = calloc(members_count ? members_count : 1,
+                              sizeof(ArchiveMember)),
+            .members_count = members_count,
+        };
+        for (uint32_t i = 0; i < members_count; i++) {
+            archive.members[i] = (ArchiveMember){
+                .name = arena_sdsprintf(&arena, "%s.o",
+                                        members[i].assets[0].var_name),
+                .object = &members[i].object,
+            };
+        }
+        file_size = layout_archive(&archive);
+    } else {
+        object = assets_object(settings.target, assets, assets_count,
+                               sections, sections_count, settings.sizes,
+                               &arena);
+        if (settings.directory) {
+            object.relocations = directory.relocations;
+            object.relocations_count = directory.relocations_count;
+            object.symbols[object.symbols_count++] = (Symbol){
+                .name = arena_sds(&arena, "crp_directory",
+                                  strlen("crp_directory")),
+                .section = sections_count - 1,
+                .value = 0,
+                .size = sizeof(crp_directory_t),
+            };
+        }
+        file_size = layout_object(&object);
+    }
+
+    // written next to the output and renamed over it when complete, unless
+    // output is something like /dev/null
+    stats_phase("write");
+    struct stat output_stat;
+    const bool in_place = stat(settings.output_file, &output_stat) == 0 &&
+                          !S_ISREG(output_stat.st_mode);
+    sds tmp_path = in_place
+                       ? sdsdup(settings.output_file)
+                       : sdscatfmt(sdsdup(settings.output_file), ".tmp");
+    Output out = {
+        .fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644),
+    };
+    stats_io(0, 0);
+    if (out.fd < 0) {
+        fprintf(stderr, "can't open %s\n", tmp_path);
+        exit(1);
+    }
+    output_reserve(&out, file_size, settings.map_output);
+
+    // copy windows of all jobs share the memory budget, rounded down to
+    // whole pages
+    const uint64_t window_size =
+        settings.max_memory / settings.jobs > page_size
+            ? settings.max_memory / settings.jobs / page_size * page_size
+            : page_size;
+    if (settings.archive) {
+        write_archive(&archive, &out);
+        write_members(&archive, members, &out, window_size, settings.sizes,
+                      spill.fd, settings.jobs);
+    } else {
+        // before the object, Mach-O keeps addends in place of pointers
+        if (settings.directory) {
+            output_write(&out, sections[sections_count - 1].file_offset,
+                         directory.content, directory.size);
+        }
+        write_object(&object, &out, settings.jobs);
+        write_assets_content(&out, &object, assets, assets_count, NULL,
+                             window_size, settings.sizes, spill.fd,
+                             settings.jobs);
+    }
+    output_close(&out);
+    if (spill.fd >= 0) {
+        close(spill.fd);
+    }
+    if (!in_place && rename(tmp_path, settings.output_file) != 0) {
+        fprintf(stderr, "can't write %s\n", settings.output_file);
+        exit(1);
+    }
+
+    if (settings.header) {
+        stats_phase("header");
+        write_header(&settings, assets, assets_count);
+    }
+    if (settings.cache) {
+        stats_phase("cache write");
+        write_cache(cache_path, key, stat_file(settings.output_file), assets,
+                    assets_count);
+    }
+    if (report) {
+        report_stats(&settings, assets, assets_count);
+    }
+    arena_free(&arena);
 }
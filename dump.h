@@ -4,17 +4,19 @@
 #include <stdint.h>
 #include <stdio.h>
 
+bool isSimplePtr = false;
+
 sds cant_dump(void *v /*unused*/, sds /*unused*/ p) {
+  isSimplePtr = false; // set for pointers to unknown types
   return sdsnew("<unknown>");
 }
 
-bool isSimplePtr = false;
-
 sds (*get_fun(char *name))(void *v, sds spit) {
   sds sds_name = sdsnew(name);
   uint32_t count;
-  sdsfreesplitres(sdssplitlen(sds_name, sdslen(sds_name), "*", 1, &count),
-                  count);
+  // count is set by the split, it can't be read in the same call
+  sds *stars = sdssplitlen(sds_name, sdslen(sds_name), "*", 1, &count);
+  sdsfreesplitres(stars, count);
   if (count == 2) {
     isSimplePtr = true;
   }
@@ -39,7 +41,8 @@ sds (*get_fun(char *name))(void *v, sds spit) {
     int64_t: sdscatfmt(padd, "%s(%s): %I", #name, #type, v->name),\
     uint32_t: sdscatfmt(padd, "%s(%s): %u", #name, #type, v->name),\
     uint64_t: sdscatfmt(padd, "%s(%s): %U", #name, #type, v->name),\
-    char: sdscatfmt(padd, "%s(%s): %%", #name, #type, v->name),\
+    char: sdscatlen(sdscatfmt(padd, "%s(%s): ", #name, #type), &v->name, 1),\
+    bool: sdscatfmt(padd, "%s(%s): %s", #name, #type, v->name ? "true" : "false"),\
     float: sdscatprintf(padd, "%s(%s): %f", #name, #type, v->name),\
     double: sdscatprintf(padd, "%s(%s): %lf", #name, #type, v->name),\
     char *: sdscatfmt(padd, "%s(%s): %s", #name, #type, v->name),\
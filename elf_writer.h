@@ -0,0 +1,344 @@
+#pragma once
+#include "object.h"
+#include <elf.h>
+
+// ELF64 relocatable object: header, sections, their .rela tables, .symtab,
+// .strtab, .shstrtab, empty .note.GNU-stack and section headers at the end.
+// With SHN_LORESERVE sections or more, the count and the index of .shstrtab
+// are in section header 0, and .symtab_shndx after .rela sections holds
+// indices of symbols' sections which don't fit st_shndx.
+
+// sections of the object go first, index 0 is the null section
+#define ELF_SECTION_INDEX(i) ((i) + 1)
+#define ELF_SECTION_SYMTAB(object) ((object)->sections_count + 1)
+#define ELF_SECTION_STRTAB(object) ((object)->sections_count + 2)
+#define ELF_SECTION_SHSTRTAB(object) ((object)->sections_count + 3)
+#define ELF_SECTION_NOTE_GNU_STACK(object) ((object)->sections_count + 4)
+// .rela of the n-th section that has relocations
+#define ELF_SECTION_RELA(object, n) ((object)->sections_count + 5 + (n))
+#define ELF_BASE_SECTIONS_COUNT(object)                                       \
+    ((object)->sections_count + 5 + elf_relocated_sections_count(object))
+#define ELF_EXTENDED(object) (ELF_BASE_SECTIONS_COUNT(object) >= SHN_LORESERVE)
+#define ELF_SECTION_SYMTAB_SHNDX(object) ELF_BASE_SECTIONS_COUNT(object)
+#define ELF_SECTIONS_COUNT(object)                                            \
+    (ELF_BASE_SECTIONS_COUNT(object) + ELF_EXTENDED(object))
+
+uint32_t elf_relocated_sections_count(Object *object) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < object->sections_count; i++) {
+        count += object->sections[i].relocations_count > 0;
+    }
+    return count;
+}
+
+uint32_t elf_relocation_type(Target target) {
+    return target == TARGET_ELF_AARCH64 ? R_AARCH64_ABS64 : R_X86_64_64;
+}
+
+// null symbol and a section symbol for every section
+#define ELF_LOCAL_SYMBOLS_COUNT(object) ((object)->sections_count + 1)
+
+// st_shndx of a symbol in section index, which is then in .symtab_shndx
+uint16_t elf_symbol_shndx(uint32_t index) {
+    return index < SHN_LORESERVE ? index : SHN_XINDEX;
+}
+
+sds elf_section_names(Object *object) {
+    sds names = sdsnewlen("", 1);
+    for (uint32_t i = 0; i < object->sections_count; i++) {
+        names = sdscatlen(names, object->sections[i].name,
+                          strlen(object->sections[i].name) + 1);
+    }
+    const char fixed_names[] = ".symtab\0.strtab\0.shstrtab\0.note.GNU-stack";
+    names = sdscatlen(names, fixed_names, sizeof(fixed_names));
+    for (uint32_t i = 0; i < object->sections_count; i++) {
+        if (object->sections[i].relocations_count > 0) {
+            names = sdscatfmt(names, ".rela%s", object->sections[i].name);
+            names = sdscatlen(names, "", 1);
+        }
+    }
+    if (ELF_EXTENDED(object)) {
+        names = sdscatlen(names, ".symtab_shndx", sizeof(".symtab_shndx"));
+    }
+    return names;
+}
+
+uint64_t layout_elf(Object *object) {
+    uint64_t cur = sizeof(Elf64_Ehdr);
+    for (uint32_t i = 0; i < object->sections_count; i++) {
+        cur = ceil_to_alignment(
+            cur, section_file_alignment(object->sections[i].align));
+        object->sections[i].file_offset = cur;
+        object->sections[i].addr = 0;
+        cur += object->sections[i].size;
+    }
+    cur = layout_relocations(object, ceil_to_alignment(cur, sizeof(uint64_t)),
+                             sizeof(Elf64_Rela));
+
+    object->sym_table_offset = ceil_to_alignment(cur, sizeof(uint64_t));
+    object->sym_str_offset =
+        object->sym_table_offset +
+        sizeof(Elf64_Sym) *
+            (ELF_LOCAL_SYMBOLS_COUNT(object) + object->symbols_count);
+    object->sym_str_size = layout_symbol_names(object, 1, "");
+    object->sym_shndx_offset = object->sym_str_offset + object->sym_str_size;
+    uint64_t sym_shndx_size = 0;
+    if (ELF_EXTENDED(object)) {
+        object->sym_shndx_offset =
+            ceil_to_alignment(object->sym_shndx_offset, sizeof(Elf64_Word));
+        sym_shndx_size =
+            sizeof(Elf64_Word) *
+            (ELF_LOCAL_SYMBOLS_COUNT(object) + object->symbols_count);
+    }
+
+    sds section_names = elf_section_names(object);
+    object->section_names_offset = object->sym_shndx_offset + sym_shndx_size;
+    object->section_headers_offset = ceil_to_alignment(
+        object->section_names_offset + sdslen(section_names),
+        sizeof(uint64_t));
+    sdsfree(section_names);
+
+    object->file_size = object->section_headers_offset +
+                        sizeof(Elf64_Shdr) * ELF_SECTIONS_COUNT(object);
+    return object->file_size;
+}
+
+typedef struct {
+    Object *object;
+    Elf64_Sym *table;
+    Elf64_Word *shndx_table; // NULL unless extended
+} ElfSymbolsCtx;
+
+void write_elf_symbols_task(void *ctx, uint32_t index) {
+    ElfSymbolsCtx *c = ctx;
+    Object *object = c->object;
+    uint32_t end = (index + 1) * SYMBOLS_PER_TASK;
+    if (end > object->symbols_count) {
+        end = object->symbols_count;
+    }
+    for (uint32_t i = index * SYMBOLS_PER_TASK; i < end; i++) {
+        Symbol *symbol = &object->symbols[i];
+        const uint32_t section = ELF_SECTION_INDEX(symbol->section);
+        c->table[i] = (Elf64_Sym){
+            .st_name = object->symbol_name_offsets[i],
+            .st_info = ELF64_ST_INFO(STB_GLOBAL, STT_OBJECT),
+            .st_other = STV_DEFAULT,
+            .st_shndx = symbol->absolute ? SHN_ABS : elf_symbol_shndx(section),
+            .st_value = symbol->value,
+            .st_size = symbol->size,
+        };
+        if (c->shndx_table) {
+            c->shndx_table[i] =
+                symbol->absolute || section < SHN_LORESERVE ? 0 : section;
+        }
+    }
+}
+
+// Writes everything but section contents, symbol and string tables are
+// filled on jobs threads.
+void write_elf(Object *object, Output *out, uint32_t jobs) {
+    const uint32_t sections_count = ELF_SECTIONS_COUNT(object);
+    const uint32_t local_symbols_count = ELF_LOCAL_SYMBOLS_COUNT(object);
+    const bool extended = ELF_EXTENDED(object);
+    const uint16_t machine =
+        object->target == TARGET_ELF_AARCH64 ? EM_AARCH64 : EM_X86_64;
+
+    {
+        Elf64_Ehdr e_header = {
+            .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64,
+                        ELFDATA2LSB, EV_CURRENT, ELFOSABI_NONE},
+            .e_type = ET_REL,
+            .e_machine = machine,
+            .e_version = EV_CURRENT,
+            .e_entry = 0,
+            .e_phoff = 0,
+            .e_shoff = object->section_headers_offset,
+            .e_flags = 0,
+            .e_ehsize = sizeof(Elf64_Ehdr),
+            .e_phentsize = 0,
+            .e_phnum = 0,
+            .e_shentsize = sizeof(Elf64_Shdr),
+            // in section header 0 if they don't fit
+            .e_shnum = extended ? 0 : sections_count,
+            .e_shstrndx = elf_symbol_shndx(ELF_SECTION_SHSTRTAB(object)),
+        };
+        output_write(out, 0, &e_header, sizeof(Elf64_Ehdr));
+    }
+    const uint64_t symbols_count = local_symbols_count + object->symbols_count;
+    {
+        const uint64_t size = sizeof(Elf64_Sym) * symbols_count;
+        Elf64_Sym *symbols_table = (Elf64_Sym *)output_region(
+            out, object->sym_table_offset, size);
+        const uint64_t shndx_size =
+            extended ? sizeof(Elf64_Word) * symbols_count : 0;
+        Elf64_Word *shndx_table =
+            extended ? (Elf64_Word *)output_region(
+                           out, object->sym_shndx_offset, shndx_size)
+                     : NULL;
+        symbols_table[0] = (Elf64_Sym){};
+        for (uint32_t i = 0; i < object->sections_count; i++) {
+            symbols_table[i + 1] = (Elf64_Sym){
+                .st_name = 0,
+                .st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION),
+                .st_other = STV_DEFAULT,
+                .st_shndx = elf_symbol_shndx(ELF_SECTION_INDEX(i)),
+                .st_value = 0,
+                .st_size = 0,
+            };
+        }
+        if (extended) {
+            shndx_table[0] = 0;
+            for (uint32_t i = 0; i < object->sections_count; i++) {
+                shndx_table[i + 1] = ELF_SECTION_INDEX(i) < SHN_LORESERVE
+                                         ? 0
+                                         : ELF_SECTION_INDEX(i);
+            }
+        }
+
+        ElfSymbolsCtx ctx = {
+            .object = object,
+            .table = symbols_table + local_symbols_count,
+            .shndx_table = extended ? shndx_table + local_symbols_count : NULL,
+        };
+        parallel_for(.threads_count = jobs,
+                     .count = (object->symbols_count + SYMBOLS_PER_TASK - 1) /
+                              SYMBOLS_PER_TASK,
+                     .fn = write_elf_symbols_task, .ctx = &ctx);
+        output_commit(out, object->sym_table_offset, (uint8_t *)symbols_table,
+                      size);
+        if (extended) {
+            output_commit(out, object->sym_shndx_offset,
+                          (uint8_t *)shndx_table, shndx_size);
+        }
+    }
+    {
+        uint8_t *names =
+            output_region(out, object->sym_str_offset, object->sym_str_size);
+        names[0] = 0;
+        write_symbol_names(object, names, "", jobs);
+        output_commit(out, object->sym_str_offset, names,
+                      object->sym_str_size);
+    }
+
+    if (object->relocations_count > 0) {
+        // addends are in the entries, pointers in sections stay zero
+        uint32_t in_section = 0;
+        for (uint32_t i = 0; i < object->relocations_count; i++) {
+            Relocation *relocation = &object->relocations[i];
+            if (i > 0 &&
+                relocation->section != object->relocations[i - 1].section) {
+                in_section = 0;
+            }
+            Elf64_Rela rela = {
+                .r_offset = relocation->offset,
+                // section symbols follow the null symbol
+                .r_info = ELF64_R_INFO(relocation->target_section + 1,
+                                       elf_relocation_type(object->target)),
+                .r_addend = relocation->target_offset,
+            };
+            output_write(out,
+                         object->sections[relocation->section]
+                                 .relocations_offset +
+                             sizeof(Elf64_Rela) * in_section++,
+                         &rela, sizeof(Elf64_Rela));
+        }
+    }
+
+    sds section_names = elf_section_names(object);
+    output_write(out, object->section_names_offset, section_names,
+                 sdslen(section_names));
+
+    {
+        Elf64_Shdr *section_headers = calloc(sections_count, sizeof(Elf64_Shdr));
+        if (extended) {
+            section_headers[0].sh_size = sections_count;
+            if (ELF_SECTION_SHSTRTAB(object) >= SHN_LORESERVE) {
+                section_headers[0].sh_link = ELF_SECTION_SHSTRTAB(object);
+            }
+        }
+        uint32_t name_pos = 1;
+        for (uint32_t i = 0; i < object->sections_count; i++) {
+            Section *section = &object->sections[i];
+            section_headers[ELF_SECTION_INDEX(i)] = (Elf64_Shdr){
+                .sh_name = name_pos,
+                .sh_type = SHT_PROGBITS,
+                .sh_flags = SHF_ALLOC | (section->writable ? SHF_WRITE : 0),
+                .sh_offset = section->file_offset,
+                .sh_size = section->size,
+                .sh_addralign = 1 << section->align,
+            };
+            name_pos += strlen(section->name) + 1;
+        }
+        section_headers[ELF_SECTION_SYMTAB(object)] = (Elf64_Shdr){
+            .sh_name = name_pos,
+            .sh_type = SHT_SYMTAB,
+            .sh_offset = object->sym_table_offset,
+            .sh_size = sizeof(Elf64_Sym) * symbols_count,
+            .sh_link = ELF_SECTION_STRTAB(object),
+            .sh_info = local_symbols_count, // first global symbol
+            .sh_addralign = sizeof(uint64_t),
+            .sh_entsize = sizeof(Elf64_Sym),
+        };
+        name_pos += sizeof(".symtab");
+        section_headers[ELF_SECTION_STRTAB(object)] = (Elf64_Shdr){
+            .sh_name = name_pos,
+            .sh_type = SHT_STRTAB,
+            .sh_offset = object->sym_str_offset,
+            .sh_size = object->sym_str_size,
+            .sh_addralign = 1,
+        };
+        name_pos += sizeof(".strtab");
+        section_headers[ELF_SECTION_SHSTRTAB(object)] = (Elf64_Shdr){
+            .sh_name = name_pos,
+            .sh_type = SHT_STRTAB,
+            .sh_offset = object->section_names_offset,
+            .sh_size = sdslen(section_names),
+            .sh_addralign = 1,
+        };
+        name_pos += sizeof(".shstrtab");
+        // marks the object as not needing an executable stack
+        section_headers[ELF_SECTION_NOTE_GNU_STACK(object)] = (Elf64_Shdr){
+            .sh_name = name_pos,
+            .sh_type = SHT_PROGBITS,
+            .sh_offset = object->section_headers_offset,
+            .sh_size = 0,
+            .sh_addralign = 1,
+        };
+        name_pos += sizeof(".note.GNU-stack");
+        uint32_t rela_index = 0;
+        for (uint32_t i = 0; i < object->sections_count; i++) {
+            Section *section = &object->sections[i];
+            if (section->relocations_count == 0) {
+                continue;
+            }
+            section_headers[ELF_SECTION_RELA(object, rela_index++)] =
+                (Elf64_Shdr){
+                    .sh_name = name_pos,
+                    .sh_type = SHT_RELA,
+                    .sh_flags = SHF_INFO_LINK,
+                    .sh_offset = section->relocations_offset,
+                    .sh_size = sizeof(Elf64_Rela) * section->relocations_count,
+                    .sh_link = ELF_SECTION_SYMTAB(object),
+                    .sh_info = ELF_SECTION_INDEX(i),
+                    .sh_addralign = sizeof(uint64_t),
+                    .sh_entsize = sizeof(Elf64_Rela),
+                };
+            name_pos += strlen(".rela") + strlen(section->name) + 1;
+        }
+        if (extended) {
+            section_headers[ELF_SECTION_SYMTAB_SHNDX(object)] = (Elf64_Shdr){
+                .sh_name = name_pos,
+                .sh_type = SHT_SYMTAB_SHNDX,
+                .sh_offset = object->sym_shndx_offset,
+                .sh_size = sizeof(Elf64_Word) * symbols_count,
+                .sh_link = ELF_SECTION_SYMTAB(object),
+                .sh_addralign = sizeof(Elf64_Word),
+                .sh_entsize = sizeof(Elf64_Word),
+            };
+        }
+        output_write(out, object->section_headers_offset, section_headers,
+                     sizeof(Elf64_Shdr) * sections_count);
+        free(section_headers);
+    }
+    sdsfree(section_names);
+}
@@ -0,0 +1,132 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+// XXH64, streaming. Fast enough to hash assets at memory bandwidth, used to
+// tell whether content of an asset changed.
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+#define HASH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME5 0x27D4EB2F165667C5ULL
+
+typedef struct {
+    uint64_t acc[4];
+    uint8_t buf[32];
+    uint32_t buf_size;
+    uint64_t total_size;
+    uint64_t seed;
+} Hasher;
+
+uint64_t hash_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+uint64_t hash_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t hash_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t hash_round(uint64_t acc, uint64_t input) {
+    acc += input * HASH_PRIME2;
+    acc = hash_rotl(acc, 31);
+    return acc * HASH_PRIME1;
+}
+
+uint64_t hash_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= hash_round(0, val);
+    return acc * HASH_PRIME1 + HASH_PRIME4;
+}
+
+Hasher hasher_new(uint64_t seed) {
+    return (Hasher){
+        .acc = {seed + HASH_PRIME1 + HASH_PRIME2, seed + HASH_PRIME2, seed,
+                seed - HASH_PRIME1},
+        .seed = seed,
+    };
+}
+
+void hasher_stripe(Hasher *h, const uint8_t *p) {
+    for (int i = 0; i < 4; i++) {
+        h->acc[i] = hash_round(h->acc[i], hash_read64(p + i * 8));
+    }
+}
+
+void hasher_update(Hasher *h, const void *data, uint64_t size) {
+    const uint8_t *p = data;
+    h->total_size += size;
+    if (h->buf_size + size < 32) {
+        memcpy(h->buf + h->buf_size, p, size);
+        h->buf_size += size;
+        return;
+    }
+    if (h->buf_size > 0) {
+        uint32_t fill = 32 - h->buf_size;
+        memcpy(h->buf + h->buf_size, p, fill);
+        hasher_stripe(h, h->buf);
+        p += fill;
+        size -= fill;
+        h->buf_size = 0;
+    }
+    while (size >= 32) {
+        hasher_stripe(h, p);
+        p += 32;
+        size -= 32;
+    }
+    memcpy(h->buf, p, size);
+    h->buf_size = size;
+}
+
+uint64_t hasher_digest(const Hasher *h) {
+    uint64_t hash;
+    if (h->total_size >= 32) {
+        hash = hash_rotl(h->acc[0], 1) + hash_rotl(h->acc[1], 7) +
+               hash_rotl(h->acc[2], 12) + hash_rotl(h->acc[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = hash_merge_round(hash, h->acc[i]);
+        }
+    } else {
+        hash = h->seed + HASH_PRIME5;
+    }
+    hash += h->total_size;
+
+    const uint8_t *p = h->buf;
+    uint32_t size = h->buf_size;
+    while (size >= 8) {
+        hash ^= hash_round(0, hash_read64(p));
+        hash = hash_rotl(hash, 27) * HASH_PRIME1 + HASH_PRIME4;
+        p += 8;
+        size -= 8;
+    }
+    if (size >= 4) {
+        hash ^= (uint64_t)hash_read32(p) * HASH_PRIME1;
+        hash = hash_rotl(hash, 23) * HASH_PRIME2 + HASH_PRIME3;
+        p += 4;
+        size -= 4;
+    }
+    while (size > 0) {
+        hash ^= (*p) * HASH_PRIME5;
+        hash = hash_rotl(hash, 11) * HASH_PRIME1;
+        p++;
+        size--;
+    }
+
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+uint64_t hash_bytes(const void *data, uint64_t size, uint64_t seed) {
+    Hasher h = hasher_new(seed);
+    hasher_update(&h, data, size);
+    return hasher_digest(&h);
+}
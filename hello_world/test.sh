@@ -1,6 +1,6 @@
 cd "$(dirname "$0")"
 mkdir -p build
-clang -w ../crp.c -o build/crp
+${CC:-cc} -w -pthread ../crp.c -o build/crp
 ./build/crp -c crp.conf build/assets.o -q
-clang src/hello_world.c build/assets.o -o hello_world
+${CC:-cc} -w src/hello_world.c build/assets.o -o hello_world
 ./hello_world
@@ -0,0 +1,211 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// LZ4 block compressor. Output is plain LZ4 block format, decoded by
+// crp_decompress() from runtime/crp.h. lz4_compress() is greedy with a single
+// hash table and is as fast as it gets; lz4_compress_high() walks hash chains
+// and looks one position ahead for a longer match, which is slower but
+// noticeably smaller, and still decodes at the same speed.
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // last bytes are always literals
+#define LZ4_MF_LIMIT 12     // last match starts at least this far from end
+#define LZ4_MAX_DISTANCE 65535
+#define LZ4_HASH_LOG 16
+#define LZ4_HIGH_ATTEMPTS 256
+
+uint64_t lz4_compress_bound(uint64_t size) { return size + size / 255 + 16; }
+
+uint32_t lz4_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+uint64_t lz4_match_length(const uint8_t *a, const uint8_t *b,
+                          const uint8_t *limit) {
+    const uint8_t *start = a;
+    while (a < limit && *a == *b) {
+        a++;
+        b++;
+    }
+    return a - start;
+}
+
+uint8_t *lz4_write_length(uint8_t *op, uint64_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+// Writes literals [anchor, ip) followed by match of match_length at offset,
+// match_length 0 means the last literals-only sequence.
+uint8_t *lz4_write_sequence(uint8_t *op, const uint8_t *anchor,
+                            const uint8_t *ip, uint64_t offset,
+                            uint64_t match_length) {
+    uint64_t literals = ip - anchor;
+    uint8_t *token = op++;
+    *token = (literals >= 15 ? 15 : literals) << 4;
+    if (literals >= 15) {
+        op = lz4_write_length(op, literals - 15);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    if (match_length == 0) {
+        return op;
+    }
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    uint64_t length = match_length - LZ4_MIN_MATCH;
+    *token |= length >= 15 ? 15 : length;
+    if (length >= 15) {
+        op = lz4_write_length(op, length - 15);
+    }
+    return op;
+}
+
+// Compresses size bytes of in to out, which must hold lz4_compress_bound()
+// bytes. Returns compressed size.
+uint64_t lz4_compress(const uint8_t *in, uint64_t size, uint8_t *out) {
+    uint8_t *op = out;
+    const uint8_t *anchor = in;
+    if (size > LZ4_MF_LIMIT) {
+        uint64_t *table = calloc(1 << LZ4_HASH_LOG, sizeof(uint64_t));
+        const uint8_t *ip = in + 1;
+        const uint8_t *match_limit = in + size - LZ4_MF_LIMIT;
+        const uint8_t *match_end = in + size - LZ4_LAST_LITERALS;
+        while (ip < match_limit) {
+            uint32_t h = lz4_hash(lz4_read32(ip));
+            const uint8_t *match = in + table[h];
+            table[h] = ip - in;
+            if (match >= ip || ip - match > LZ4_MAX_DISTANCE ||
+                lz4_read32(match) != lz4_read32(ip)) {
+                ip++;
+                continue;
+            }
+            // extend backwards over literals
+            while (ip > anchor && match > in && ip[-1] == match[-1]) {
+                ip--;
+                match--;
+            }
+            uint64_t length = LZ4_MIN_MATCH +
+                              lz4_match_length(ip + LZ4_MIN_MATCH,
+                                               match + LZ4_MIN_MATCH,
+                                               match_end);
+            op = lz4_write_sequence(op, anchor, ip, ip - match, length);
+            ip += length;
+            anchor = ip;
+            if (ip - 2 > in && ip - 2 < match_limit) {
+                table[lz4_hash(lz4_read32(ip - 2))] = ip - 2 - in;
+            }
+        }
+        free(table);
+    }
+    op = lz4_write_sequence(op, anchor, in + size, 0, 0);
+    return op - out;
+}
+
+typedef struct {
+    uint64_t *head;  // last position with given hash
+    uint16_t *chain; // distance to previous position with the same hash
+    const uint8_t *in;
+    uint64_t next; // first position not inserted yet
+} Lz4Chains;
+
+void lz4_chains_insert(Lz4Chains *c, const uint8_t *ip) {
+    while (c->next <= (uint64_t)(ip - c->in)) {
+        uint64_t pos = c->next++;
+        uint32_t h = lz4_hash(lz4_read32(c->in + pos));
+        uint64_t distance = pos - c->head[h];
+        c->chain[pos & 0xffff] =
+            distance > LZ4_MAX_DISTANCE ? LZ4_MAX_DISTANCE : distance;
+        c->head[h] = pos;
+    }
+}
+
+// Longest match for ip among LZ4_HIGH_ATTEMPTS previous positions with the
+// same hash.
+uint64_t lz4_longest_match(Lz4Chains *c, const uint8_t *ip,
+                           const uint8_t *match_end, const uint8_t **match) {
+    lz4_chains_insert(c, ip);
+    uint64_t best = 0;
+    uint64_t pos = ip - c->in;
+    uint64_t candidate = pos;
+    for (int attempts = LZ4_HIGH_ATTEMPTS; attempts > 0; attempts--) {
+        uint16_t distance = c->chain[candidate & 0xffff];
+        if (distance == 0 || distance > candidate) {
+            break;
+        }
+        candidate -= distance;
+        if (pos - candidate > LZ4_MAX_DISTANCE) {
+            break;
+        }
+        const uint8_t *m = c->in + candidate;
+        if (m[best] == ip[best] && lz4_read32(m) == lz4_read32(ip)) {
+            uint64_t length = LZ4_MIN_MATCH +
+                              lz4_match_length(ip + LZ4_MIN_MATCH,
+                                               m + LZ4_MIN_MATCH, match_end);
+            if (length > best) {
+                best = length;
+                *match = m;
+            }
+        }
+    }
+    return best;
+}
+
+// Same format as lz4_compress(), smaller output, several times slower.
+uint64_t lz4_compress_high(const uint8_t *in, uint64_t size, uint8_t *out) {
+    uint8_t *op = out;
+    const uint8_t *anchor = in;
+    if (size > LZ4_MF_LIMIT) {
+        Lz4Chains chains = {
+            .head = calloc(1 << LZ4_HASH_LOG, sizeof(uint64_t)),
+            .chain = calloc(1 << 16, sizeof(uint16_t)),
+            .in = in,
+            .next = 0,
+        };
+        const uint8_t *ip = in;
+        const uint8_t *match_limit = in + size - LZ4_MF_LIMIT;
+        const uint8_t *match_end = in + size - LZ4_LAST_LITERALS;
+        while (ip < match_limit) {
+            const uint8_t *match;
+            uint64_t length = lz4_longest_match(&chains, ip, match_end, &match);
+            if (length < LZ4_MIN_MATCH) {
+                ip++;
+                continue;
+            }
+            // lazy matching: take a literal if the next position matches
+            // longer
+            while (ip + 1 < match_limit) {
+                const uint8_t *next_match;
+                uint64_t next_length = lz4_longest_match(&chains, ip + 1,
+                                                         match_end,
+                                                         &next_match);
+                if (next_length <= length) {
+                    break;
+                }
+                ip++;
+                length = next_length;
+                match = next_match;
+            }
+            op = lz4_write_sequence(op, anchor, ip, ip - match, length);
+            ip += length;
+            anchor = ip;
+        }
+        free(chains.head);
+        free(chains.chain);
+    }
+    op = lz4_write_sequence(op, anchor, in + size, 0, 0);
+    return op - out;
+}
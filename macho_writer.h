@@ -0,0 +1,343 @@
+#pragma once
+#include "object.h"
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+#include <mach-o/reloc.h>
+#include <mach-o/arm64/reloc.h>
+
+// Mach-O arm64 object: header, one unnamed segment with an empty
+// __TEXT,__text followed by the sections of the object, build version,
+// symbol table and string table. Section contents follow load commands in
+// the same order, each at its alignment capped by section_file_alignment()
+// so big address alignments don't pad the file, relocations of sections
+// follow contents.
+
+// __text is section 1, sections of the object follow it
+#define MACHO_SECTIONS_COUNT(object) ((object)->sections_count + 1)
+#define MACHO_SECTION_INDEX(i) ((i) + 2)
+
+uint32_t macho_sizeofcmds(Object *object) {
+    return sizeof(struct segment_command_64) +
+           sizeof(struct section_64) * MACHO_SECTIONS_COUNT(object) +
+           sizeof(struct build_version_command) +
+           sizeof(struct symtab_command) + sizeof(struct dysymtab_command);
+}
+
+// Names of local symbols marking start of every section: "ltmp<n>", the
+// last section gets ltmp0.
+sds macho_local_symbols_str(Object *object) {
+    sds names = sdsnewlen("", 1);
+    for (uint32_t i = 0; i < MACHO_SECTIONS_COUNT(object); i++) {
+        names = sdscatfmt(names, "ltmp%u",
+                          MACHO_SECTIONS_COUNT(object) - 1 - i);
+        names = sdscatlen(names, "", 1);
+    }
+    return names;
+}
+
+uint64_t macho_data_offset(Object *object) {
+    uint32_t max_align = 0;
+    for (uint32_t i = 0; i < object->sections_count; i++) {
+        if (object->sections[i].align > max_align) {
+            max_align = object->sections[i].align;
+        }
+    }
+    return ceil_to_alignment(sizeof(struct mach_header_64) +
+                                 macho_sizeofcmds(object),
+                             section_file_alignment(max_align));
+}
+
+uint64_t layout_macho(Object *object) {
+    const uint64_t data_offset = macho_data_offset(object);
+    uint64_t addr = 0;
+    uint64_t cur = data_offset;
+    for (uint32_t i = 0; i < object->sections_count; i++) {
+        Section *section = &object->sections[i];
+        addr = ceil_to_alignment(addr, 1ULL << section->align);
+        section->addr = addr;
+        addr += section->size;
+        cur = ceil_to_alignment(cur, section_file_alignment(section->align));
+        section->file_offset = cur;
+        cur += section->size;
+    }
+
+    const uint64_t relocations_end = layout_relocations(
+        object, ceil_to_alignment(cur, sizeof(long)),
+        sizeof(struct relocation_info));
+    object->sym_table_offset = ceil_to_alignment(relocations_end, sizeof(long));
+    object->sym_str_offset =
+        object->sym_table_offset +
+        sizeof(struct nlist_64) *
+            (MACHO_SECTIONS_COUNT(object) + object->symbols_count);
+    sds local_symbols_str = macho_local_symbols_str(object);
+    object->sym_str_size = ceil_to_alignment(
+        layout_symbol_names(object, sdslen(local_symbols_str), "_"),
+        sizeof(long));
+    sdsfree(local_symbols_str);
+
+    object->file_size = object->sym_str_offset + object->sym_str_size;
+    return object->file_size;
+}
+
+// Size of the segment, which is end of the last section.
+uint64_t macho_segment_size(Object *object) {
+    if (object->sections_count == 0) {
+        return 0;
+    }
+    Section *last = &object->sections[object->sections_count - 1];
+    return last->addr + last->size;
+}
+
+// Size of contents of the segment in the file, less than its size when a
+// section is aligned more than in the file.
+uint64_t macho_segment_file_size(Object *object) {
+    if (object->sections_count == 0) {
+        return 0;
+    }
+    Section *last = &object->sections[object->sections_count - 1];
+    return last->file_offset + last->size - macho_data_offset(object);
+}
+
+typedef struct {
+    Object *object;
+    struct nlist_64 *table;
+} MachoSymbolsCtx;
+
+void write_macho_symbols_task(void *ctx, uint32_t index) {
+    MachoSymbolsCtx *c = ctx;
+    Object *object = c->object;
+    uint32_t end = (index + 1) * SYMBOLS_PER_TASK;
+    if (end > object->symbols_count) {
+        end = object->symbols_count;
+    }
+    for (uint32_t i = index * SYMBOLS_PER_TASK; i < end; i++) {
+        Symbol *symbol = &object->symbols[i];
+        if (symbol->absolute) {
+            c->table[i] = (struct nlist_64){
+                .n_un.n_strx = object->symbol_name_offsets[i],
+                .n_type = N_ABS | N_EXT,
+                .n_sect = NO_SECT,
+                .n_desc = 0,
+                .n_value = symbol->value,
+            };
+            continue;
+        }
+        c->table[i] = (struct nlist_64){
+            .n_un.n_strx = object->symbol_name_offsets[i],
+            .n_type = N_TYPE & N_SECT | N_EXT,
+            .n_sect = MACHO_SECTION_INDEX(symbol->section),
+            // keeps -dead_strip from splitting the data at the symbol
+            .n_desc = symbol->inside ? N_ALT_ENTRY : 0,
+            .n_value = object->sections[symbol->section].addr + symbol->value,
+        };
+    }
+}
+
+// Writes everything but section contents, symbol and string tables are
+// filled on jobs threads.
+void write_macho(Object *object, Output *out, uint32_t jobs) {
+    const uint32_t sections_count = MACHO_SECTIONS_COUNT(object);
+    const uint32_t sizeofcmds = macho_sizeofcmds(object);
+    const uint64_t data_offset = macho_data_offset(object);
+    const uint64_t segment_size = macho_segment_size(object);
+    // nothing to execute, write access only when some section needs it
+    vm_prot_t protection = VM_PROT_READ;
+    for (uint32_t i = 0; i < object->sections_count; i++) {
+        if (object->sections[i].writable) {
+            protection |= VM_PROT_WRITE;
+        }
+    }
+    sds local_symbols_str = macho_local_symbols_str(object);
+
+    uint8_t *commands = output_region(out, 0, data_offset);
+    uint8_t *cur = commands;
+    {
+        struct mach_header_64 m_header = {
+            .magic = MH_MAGIC_64,
+            .cputype = CPU_TYPE_ARM64,
+            .cpusubtype = CPU_SUBTYPE_ARM64_ALL,
+            .filetype = MH_OBJECT,
+            .ncmds = 4,
+            .sizeofcmds = sizeofcmds,
+            .flags = MH_SUBSECTIONS_VIA_SYMBOLS,
+        };
+        memcpy(cur, &m_header, sizeof(struct mach_header_64));
+        cur += sizeof(struct mach_header_64);
+    }
+    {
+        struct segment_command_64 load_command_segment = {
+            .cmd = LC_SEGMENT_64,
+            .cmdsize = (sizeof(struct section_64) * sections_count +
+                        sizeof(struct segment_command_64)),
+            .segname = {},
+            .vmaddr = 0,
+            .vmsize = segment_size,
+            .fileoff = data_offset,
+            .filesize = macho_segment_file_size(object),
+            .maxprot = protection,
+            .initprot = protection,
+            .nsects = sections_count,
+            .flags = 0,
+        };
+        memcpy(cur, &load_command_segment, sizeof(struct segment_command_64));
+        cur += sizeof(struct segment_command_64);
+    }
+    {
+        struct section_64 section_text = {
+            .sectname = SECT_TEXT,
+            .segname = SEG_TEXT,
+            .addr = 0,
+            .size = 0,
+            .offset = data_offset,
+            .align = 0,
+            .reloff = 0,
+            .nreloc = 0,
+            .flags = S_ATTR_PURE_INSTRUCTIONS,
+            .reserved1 = 0,
+            .reserved2 = 0,
+            .reserved3 = 0,
+        };
+        memcpy(cur, &section_text, sizeof(struct section_64));
+        cur += sizeof(struct section_64);
+    }
+    for (uint32_t i = 0; i < object->sections_count; i++) {
+        Section *section = &object->sections[i];
+        struct section_64 section_data = {
+            .addr = section->addr,
+            .size = section->size,
+            .offset = section->file_offset,
+            .align = section->align,
+            .reloff = section->relocations_count ? section->relocations_offset
+                                                 : 0,
+            .nreloc = section->relocations_count,
+            .flags = 0,
+            .reserved1 = 0,
+            .reserved2 = 0,
+            .reserved3 = 0,
+        };
+        strncpy(section_data.sectname, section->sectname,
+                sizeof(section_data.sectname));
+        strncpy(section_data.segname, section->segname,
+                sizeof(section_data.segname));
+        memcpy(cur, &section_data, sizeof(struct section_64));
+        cur += sizeof(struct section_64);
+    }
+    {
+        struct build_version_command command_build_version = {
+            .cmd = LC_BUILD_VERSION,
+            .cmdsize = sizeof(struct build_version_command),
+            .platform = PLATFORM_MACOS,
+            .minos = 0x000e0000,
+            .sdk = 0x000f0200,
+            .ntools = 0,
+        };
+        memcpy(cur, &command_build_version,
+               sizeof(struct build_version_command));
+        cur += sizeof(struct build_version_command);
+    }
+    {
+        struct symtab_command load_command_symtab = {
+            .cmd = LC_SYMTAB,
+            .cmdsize = sizeof(struct symtab_command),
+            .symoff = object->sym_table_offset,
+            .nsyms = sections_count + object->symbols_count,
+            .stroff = object->sym_str_offset,
+            .strsize = object->sym_str_size,
+        };
+        memcpy(cur, &load_command_symtab, sizeof(struct symtab_command));
+        cur += sizeof(struct symtab_command);
+    }
+    {
+        struct dysymtab_command load_command_dysymtab = {
+            .cmd = LC_DYSYMTAB,
+            .cmdsize = sizeof(struct dysymtab_command),
+            .ilocalsym = 0,
+            .nlocalsym = sections_count,
+            .iextdefsym = sections_count,
+            .nextdefsym = object->symbols_count,
+            .iundefsym = sections_count + object->symbols_count,
+            .nundefsym = 0,
+            .tocoff = 0,
+            .ntoc = 0,
+            .modtaboff = 0,
+            .nmodtab = 0,
+            .extrefsymoff = 0,
+            .nextrefsyms = 0,
+            .indirectsymoff = 0,
+            .nindirectsyms = 0,
+            .extreloff = 0,
+            .nextrel = 0,
+            .locreloff = 0,
+            .nlocrel = 0,
+        };
+        memcpy(cur, &load_command_dysymtab, sizeof(struct dysymtab_command));
+        cur += sizeof(struct dysymtab_command);
+    }
+    output_commit(out, 0, commands, data_offset);
+
+    // relocations are against local symbols at starts of sections, addends
+    // are kept in place of pointers
+    uint32_t in_section = 0;
+    for (uint32_t i = 0; i < object->relocations_count; i++) {
+        Relocation *relocation = &object->relocations[i];
+        if (i > 0 &&
+            relocation->section != object->relocations[i - 1].section) {
+            in_section = 0;
+        }
+        struct relocation_info info = {
+            .r_address = relocation->offset,
+            .r_symbolnum = relocation->target_section + 1,
+            .r_pcrel = 0,
+            .r_length = 3,
+            .r_extern = 1,
+            .r_type = ARM64_RELOC_UNSIGNED,
+        };
+        Section *section = &object->sections[relocation->section];
+        output_write(out,
+                     section->relocations_offset +
+                         sizeof(struct relocation_info) * in_section++,
+                     &info, sizeof(struct relocation_info));
+        output_write(out, section->file_offset + relocation->offset,
+                     &relocation->target_offset, sizeof(uint64_t));
+    }
+
+    {
+        const uint64_t size =
+            sizeof(struct nlist_64) * (sections_count + object->symbols_count);
+        struct nlist_64 *symbols_table = (struct nlist_64 *)output_region(
+            out, object->sym_table_offset, size);
+
+        // local symbols pointing to start of every section
+        uint32_t local_name_pos = 1;
+        for (uint32_t i = 0; i < sections_count; i++) {
+            symbols_table[i] = (struct nlist_64){
+                .n_un.n_strx = local_name_pos,
+                .n_type = N_TYPE & N_SECT,
+                .n_sect = i + 1,
+                .n_desc = 0,
+                .n_value = i == 0 ? 0 : object->sections[i - 1].addr,
+            };
+            local_name_pos += strlen(local_symbols_str + local_name_pos) + 1;
+        }
+
+        MachoSymbolsCtx ctx = {
+            .object = object,
+            .table = symbols_table + sections_count,
+        };
+        parallel_for(.threads_count = jobs,
+                     .count = (object->symbols_count + SYMBOLS_PER_TASK - 1) /
+                              SYMBOLS_PER_TASK,
+                     .fn = write_macho_symbols_task, .ctx = &ctx);
+        output_commit(out, object->sym_table_offset, (uint8_t *)symbols_table,
+                      size);
+    }
+    {
+        uint8_t *names =
+            output_region(out, object->sym_str_offset, object->sym_str_size);
+        memcpy(names, local_symbols_str, sdslen(local_symbols_str));
+        write_symbol_names(object, names, "_", jobs);
+        output_commit(out, object->sym_str_offset, names,
+                      object->sym_str_size);
+    }
+    sdsfree(local_symbols_str);
+}
@@ -0,0 +1,331 @@
+#pragma once
+#include "arena.h"
+#include "pool.h"
+#include "sds.h"
+#include "stats.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Format independent description of an object file. Callers describe
+// sections and symbols, writers (macho_writer.h, elf_writer.h) place them in
+// the file and write headers, symbol and string tables. Section contents are
+// written by callers at Section.file_offset once the object is laid out.
+
+typedef enum {
+    TARGET_MACHO_ARM64,
+    TARGET_ELF_X86_64,
+    TARGET_ELF_AARCH64,
+    TARGETS_COUNT,
+} Target;
+
+const char *target_names[TARGETS_COUNT] = {
+    [TARGET_MACHO_ARM64] = "macho-arm64",
+    [TARGET_ELF_X86_64] = "elf-x86_64",
+    [TARGET_ELF_AARCH64] = "elf-aarch64",
+};
+
+#if defined(__APPLE__)
+#define DEFAULT_TARGET TARGET_MACHO_ARM64
+#elif defined(__aarch64__)
+#define DEFAULT_TARGET TARGET_ELF_AARCH64
+#else
+#define DEFAULT_TARGET TARGET_ELF_X86_64
+#endif
+
+typedef struct {
+    const char *name;     // ELF name, e.g. ".data"
+    const char *segname;  // Mach-O segment, e.g. "__DATA"
+    const char *sectname; // Mach-O section, e.g. "__data"
+    uint64_t size;
+    uint32_t align; // log2
+    bool writable;
+
+    // set by layout
+    uint64_t file_offset;
+    uint64_t addr; // Mach-O address of the section within the object
+    uint64_t relocations_offset;
+    uint32_t relocations_count;
+} Section;
+
+typedef struct {
+    sds name; // without platform prefix
+    uint32_t section;
+    uint64_t value; // offset in section, or the value itself if absolute
+    uint64_t size;
+    bool absolute; // not in any section, its address is value
+    bool inside;   // points into data of the symbol before it
+} Symbol;
+
+// 64-bit absolute pointer at offset of section to target_offset of
+// target_section. Writers emit the relocation and whatever the format keeps
+// in place of the pointer, callers leave those 8 bytes zero.
+typedef struct {
+    uint32_t section;
+    uint64_t offset;
+    uint32_t target_section;
+    uint64_t target_offset;
+} Relocation;
+
+typedef struct {
+    Target target;
+    Section *sections;
+    uint32_t sections_count;
+    Symbol *symbols;
+    uint32_t symbols_count;
+    Relocation *relocations; // sorted by section
+    uint32_t relocations_count;
+
+    // set by layout
+    uint64_t file_size;
+    uint64_t sym_table_offset;
+    uint64_t sym_str_offset;
+    uint64_t sym_str_size;
+    uint32_t *symbol_name_offsets;
+    bool *symbol_name_merged; // name is the tail of another one
+    uint64_t sym_shndx_offset;       // ELF only
+    uint64_t section_names_offset;   // ELF only
+    uint64_t section_headers_offset; // ELF only
+} Object;
+
+uint64_t ceil_to_alignment(uint64_t cur, uint64_t alignment) {
+    return (cur + alignment - 1) / alignment * alignment;
+}
+
+// Sections are placed in the file at their alignment up to 64K, enough to
+// share blocks with asset files on any page size. Bigger ones (2M) only
+// matter for addresses and would pad the object with zeros.
+#define SECTION_FILE_ALIGN_MAX 16 // log2
+
+uint64_t section_file_alignment(uint32_t align) {
+    return 1ULL << (align < SECTION_FILE_ALIGN_MAX ? align
+                                                   : SECTION_FILE_ALIGN_MAX);
+}
+
+// Places relocation entries of every section, entry_size bytes each, one
+// section after another from cur. Returns the end.
+uint64_t layout_relocations(Object *object, uint64_t cur,
+                            uint64_t entry_size) {
+    for (uint32_t i = 0; i < object->sections_count; i++) {
+        object->sections[i].relocations_count = 0;
+    }
+    for (uint32_t i = 0; i < object->relocations_count; i++) {
+        object->sections[object->relocations[i].section].relocations_count++;
+    }
+    for (uint32_t i = 0; i < object->sections_count; i++) {
+        object->sections[i].relocations_offset = cur;
+        cur += entry_size * object->sections[i].relocations_count;
+    }
+    return cur;
+}
+
+void pwrite_all(int fd, const uint8_t *buf, uint64_t count, uint64_t offset) {
+    while (count > 0) {
+        ssize_t written = pwrite(fd, buf, count, offset);
+        stats_io(0, written > 0 ? written : 0);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "can't write output: %s\n", strerror(errno));
+            exit(1);
+        }
+        buf += written;
+        count -= written;
+        offset += written;
+    }
+}
+
+// Output file written at absolute offsets. When mapped, regions point right
+// into the file and threads fill them in place; otherwise regions are
+// scratch buffers written out by output_commit(). Offsets are relative to
+// base, where the object starts in archives.
+typedef struct {
+    int fd;
+    uint8_t *map;
+    uint64_t size;
+    uint64_t base;
+} Output;
+
+// Sets final size of the output, everything not written reads as zeros.
+void output_reserve(Output *out, uint64_t size, bool map) {
+    stats_io(0, 0);
+    if (ftruncate(out->fd, size) != 0) {
+        fprintf(stderr, "can't resize output: %s\n", strerror(errno));
+        exit(1);
+    }
+    out->size = size;
+    if (map && size > 0) {
+        stats_io(0, 0);
+        out->map =
+            mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, out->fd, 0);
+        if (out->map == MAP_FAILED) {
+            fprintf(stderr, "can't map output: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+}
+
+uint8_t *output_region(Output *out, uint64_t offset, uint64_t size) {
+    if (out->map) {
+        return out->map + out->base + offset;
+    }
+    return calloc(size ? size : 1, 1);
+}
+
+void output_commit(Output *out, uint64_t offset, uint8_t *region,
+                   uint64_t size) {
+    if (!out->map) {
+        pwrite_all(out->fd, region, size, out->base + offset);
+        free(region);
+    } else {
+        stats_mapped_write(size);
+    }
+}
+
+void output_write(Output *out, uint64_t offset, const void *buf,
+                  uint64_t size) {
+    if (out->map) {
+        memcpy(out->map + out->base + offset, buf, size);
+        stats_mapped_write(size);
+    } else {
+        pwrite_all(out->fd, buf, size, out->base + offset);
+    }
+}
+
+void output_close(Output *out) {
+    if (out->map) {
+        munmap(out->map, out->size);
+        out->map = NULL;
+    }
+    close(out->fd);
+}
+
+typedef struct {
+    sds name; // with prefix
+    uint32_t index;
+} NameKey;
+
+// Orders names by their reversed bytes, so a name is followed by names that
+// end with it.
+int compare_name_key_tails(const void *a, const void *b) {
+    sds x = ((const NameKey *)a)->name;
+    sds y = ((const NameKey *)b)->name;
+    size_t x_length = sdslen(x);
+    size_t y_length = sdslen(y);
+    for (size_t i = 1; i <= x_length && i <= y_length; i++) {
+        if (x[x_length - i] != y[y_length - i]) {
+            return (uint8_t)x[x_length - i] < (uint8_t)y[y_length - i] ? -1
+                                                                        : 1;
+        }
+    }
+    if (x_length != y_length) {
+        return x_length < y_length ? -1 : 1;
+    }
+    return ((const NameKey *)a)->index - ((const NameKey *)b)->index;
+}
+
+// Assigns every symbol name an offset in the string table, names follow
+// `first` bytes of format specific strings and get `prefix` prepended.
+// Like linkers merge strings, a name that is the tail of another one, e.g.
+// "foo_len" of "bar_foo_len", points into it instead of being stored again.
+// Returns size of the table.
+uint64_t layout_symbol_names(Object *object, uint64_t first,
+                             const char *prefix) {
+    const uint32_t count = object->symbols_count;
+    object->symbol_name_offsets = calloc(count ? count : 1, sizeof(uint32_t));
+    object->symbol_name_merged = calloc(count ? count : 1, sizeof(bool));
+
+    // prefixed names only live until offsets are known
+    const size_t prefix_length = strlen(prefix);
+    Arena names = {};
+    NameKey *keys = calloc(count ? count : 1, sizeof(NameKey));
+    for (uint32_t i = 0; i < count; i++) {
+        const sds symbol_name = object->symbols[i].name;
+        sds name =
+            arena_sdsalloc(&names, prefix_length + sdslen(symbol_name));
+        memcpy(name, prefix, prefix_length);
+        memcpy(name + prefix_length, symbol_name, sdslen(symbol_name));
+        keys[i] = (NameKey){.name = name, .index = i};
+    }
+    qsort(keys, count, sizeof(NameKey), compare_name_key_tails);
+    // hosts[i] is the symbol whose name contains the name of symbol i at its
+    // end, the next name in tail order ends with this one if any does
+    uint32_t *hosts = calloc(count ? count : 1, sizeof(uint32_t));
+    for (uint32_t i = count; i-- > 0;) {
+        sds name = keys[i].name;
+        uint32_t host = keys[i].index;
+        if (i + 1 < count) {
+            sds next = keys[i + 1].name;
+            size_t skip = sdslen(next) - sdslen(name);
+            if (sdslen(next) >= sdslen(name) &&
+                memcmp(next + skip, name, sdslen(name)) == 0) {
+                host = hosts[keys[i + 1].index];
+            }
+        }
+        hosts[keys[i].index] = host;
+    }
+    arena_free(&names);
+    free(keys);
+
+    uint64_t current_pos = first;
+    for (uint32_t i = 0; i < count; i++) {
+        if (hosts[i] == i) {
+            object->symbol_name_offsets[i] = current_pos;
+            current_pos += prefix_length + sdslen(object->symbols[i].name) + 1;
+        }
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (hosts[i] != i) {
+            object->symbol_name_offsets[i] =
+                object->symbol_name_offsets[hosts[i]] +
+                sdslen(object->symbols[hosts[i]].name) -
+                sdslen(object->symbols[i].name);
+            object->symbol_name_merged[i] = true;
+        }
+    }
+    free(hosts);
+    return current_pos;
+}
+
+typedef struct {
+    Object *object;
+    uint8_t *table;
+    const char *prefix;
+} SymbolNamesCtx;
+
+#define SYMBOLS_PER_TASK 4096
+
+void write_symbol_names_task(void *ctx, uint32_t index) {
+    SymbolNamesCtx *c = ctx;
+    const size_t prefix_length = strlen(c->prefix);
+    uint32_t end = (index + 1) * SYMBOLS_PER_TASK;
+    if (end > c->object->symbols_count) {
+        end = c->object->symbols_count;
+    }
+    for (uint32_t i = index * SYMBOLS_PER_TASK; i < end; i++) {
+        if (c->object->symbol_name_merged[i]) {
+            continue; // written with the name it's the tail of
+        }
+        uint8_t *name = c->table + c->object->symbol_name_offsets[i];
+        memcpy(name, c->prefix, prefix_length);
+        memcpy(name + prefix_length, c->object->symbols[i].name,
+               sdslen(c->object->symbols[i].name) + 1);
+    }
+}
+
+// Fills names laid out by layout_symbol_names() into string table on jobs
+// threads.
+void write_symbol_names(Object *object, uint8_t *table, const char *prefix,
+                        uint32_t jobs) {
+    SymbolNamesCtx ctx = {.object = object, .table = table, .prefix = prefix};
+    parallel_for(.threads_count = jobs,
+                 .count = (object->symbols_count + SYMBOLS_PER_TASK - 1) /
+                          SYMBOLS_PER_TASK,
+                 .fn = write_symbol_names_task, .ctx = &ctx);
+}
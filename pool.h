@@ -0,0 +1,71 @@
+#pragma once
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Runs fn(ctx, i) for every i in [0, count) on up to threads_count threads.
+// If order is given, indices are handed out in that order, e.g. biggest job
+// first so a huge one doesn't end up running alone at the tail. Threads take
+// the next index as soon as they are done with the previous one, so the load
+// evens out by itself.
+
+typedef void (*parallel_for_task)(void *ctx, uint32_t index);
+
+typedef struct {
+    parallel_for_task fn;
+    void *ctx;
+    const uint32_t *order;
+    uint32_t count;
+    _Atomic uint32_t next;
+} parallel_for_state;
+
+void *parallel_for_worker(void *arg) {
+    parallel_for_state *state = arg;
+    for (;;) {
+        uint32_t i = atomic_fetch_add(&state->next, 1);
+        if (i >= state->count) {
+            return NULL;
+        }
+        state->fn(state->ctx, state->order ? state->order[i] : i);
+    }
+}
+
+typedef struct {
+    uint32_t threads_count;
+    uint32_t count;
+    const uint32_t *order;
+    parallel_for_task fn;
+    void *ctx;
+} parallel_for_args;
+
+void parallel_for_fn(parallel_for_args args) {
+    parallel_for_state state = {
+        .fn = args.fn,
+        .ctx = args.ctx,
+        .order = args.order,
+        .count = args.count,
+        .next = 0,
+    };
+    uint32_t threads_count = args.threads_count;
+    if (threads_count > args.count) {
+        threads_count = args.count;
+    }
+    if (threads_count <= 1) {
+        parallel_for_worker(&state);
+        return;
+    }
+
+    // calling thread is one of the workers
+    pthread_t *threads = calloc(threads_count - 1, sizeof(pthread_t));
+    for (uint32_t i = 0; i < threads_count - 1; i++) {
+        pthread_create(&threads[i], NULL, parallel_for_worker, &state);
+    }
+    parallel_for_worker(&state);
+    for (uint32_t i = 0; i < threads_count - 1; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+#define parallel_for(...) parallel_for_fn((parallel_for_args){__VA_ARGS__})
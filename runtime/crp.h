@@ -0,0 +1,305 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Runtime for assets embedded by crp, header only. Include it wherever the
+// assets are used, it has no dependencies and works from C and C++.
+
+// With --abs-sizes, <name>_len is an absolute symbol whose address is the
+// size, so reading it costs no data load:
+//   CRP_EXTERN_SIZE(config_json_len);
+//   uint64_t size = CRP_SIZE(config_json_len);
+// Position independent code can't take an absolute address PC relative, so
+// the size is loaded from the GOT, which linkers turn into an immediate, and
+// a missing object fails to link. Elsewhere the declaration is weak to get
+// the GOT load from the compiler and a missing object makes sizes 0.
+#define CRP_EXTERN_SIZE(name) extern const uint8_t name[]
+
+#ifdef __APPLE__
+#define CRP_SYMBOL(name) "_" #name
+#else
+#define CRP_SYMBOL(name) #name
+#endif
+
+#if defined(__x86_64__)
+#define CRP_SIZE(name)                                                         \
+    __extension__({                                                            \
+        uint64_t crp_size_;                                                    \
+        __asm__("movq " CRP_SYMBOL(name) "@GOTPCREL(%%rip), %0"                \
+                : "=r"(crp_size_));                                            \
+        crp_size_;                                                             \
+    })
+#elif defined(__aarch64__) && defined(__APPLE__)
+#define CRP_SIZE(name)                                                         \
+    __extension__({                                                            \
+        uint64_t crp_size_;                                                    \
+        __asm__("adrp %0, " CRP_SYMBOL(name) "@GOTPAGE\n\t"                    \
+                "ldr %0, [%0, " CRP_SYMBOL(name) "@GOTPAGEOFF]"                \
+                : "=r"(crp_size_));                                            \
+        crp_size_;                                                             \
+    })
+#elif defined(__aarch64__)
+#define CRP_SIZE(name)                                                         \
+    __extension__({                                                            \
+        uint64_t crp_size_;                                                    \
+        __asm__("adrp %0, :got:" CRP_SYMBOL(name) "\n\t"                       \
+                "ldr %0, [%0, #:got_lo12:" CRP_SYMBOL(name) "]"                \
+                : "=r"(crp_size_));                                            \
+        crp_size_;                                                             \
+    })
+#else
+#undef CRP_EXTERN_SIZE
+#define CRP_EXTERN_SIZE(name) extern const uint8_t name[] __attribute__((weak))
+#define CRP_SIZE(name) ((uint64_t)(uintptr_t)(name))
+#endif
+
+// Compressed assets ('z' and 'Z' in config) point to decompressed and
+// compressed sizes (uint64_t each, not necessarily aligned) followed by an
+// LZ4 block. <name>_len holds the decompressed size as well.
+#define CRP_COMPRESSED_HEADER_SIZE 16
+
+static inline uint64_t crp_read64(const void *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t crp_decompressed_size(const void *asset) {
+    return crp_read64(asset);
+}
+
+// Decodes an LZ4 block, never reads or writes out of bounds. Returns
+// decompressed size or -1 if dst is too small or src is corrupt.
+static inline int64_t crp_lz4_decode(const uint8_t *src, uint64_t src_size,
+                                     uint8_t *dst, uint64_t dst_size) {
+    const uint8_t *ip = src;
+    const uint8_t *const in_end = src + src_size;
+    uint8_t *op = dst;
+    uint8_t *const out_end = dst + dst_size;
+    while (ip < in_end) {
+        const unsigned token = *ip++;
+        uint64_t length = token >> 4;
+        if (length == 15) {
+            unsigned b;
+            do {
+                if (ip >= in_end) {
+                    return -1;
+                }
+                b = *ip++;
+                length += b;
+            } while (b == 255);
+        }
+        if (length > (uint64_t)(in_end - ip) ||
+            length > (uint64_t)(out_end - op)) {
+            return -1;
+        }
+        memcpy(op, ip, length);
+        op += length;
+        ip += length;
+        if (ip == in_end) {
+            break; // the last sequence has literals only
+        }
+
+        if (in_end - ip < 2) {
+            return -1;
+        }
+        const uint64_t offset = ip[0] | (uint64_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (uint64_t)(op - dst)) {
+            return -1;
+        }
+        length = token & 15;
+        if (length == 15) {
+            unsigned b;
+            do {
+                if (ip >= in_end) {
+                    return -1;
+                }
+                b = *ip++;
+                length += b;
+            } while (b == 255);
+        }
+        length += 4;
+        if (length > (uint64_t)(out_end - op)) {
+            return -1;
+        }
+        const uint8_t *match = op - offset;
+        if (offset >= length) {
+            memcpy(op, match, length);
+        } else {
+            // overlapping match repeats the last offset bytes
+            for (uint64_t i = 0; i < length; i++) {
+                op[i] = match[i];
+            }
+        }
+        op += length;
+    }
+    return op - dst;
+}
+
+// Decompresses asset into dst of capacity bytes, capacity of <name>_len is
+// enough. Returns decompressed size or -1 on error.
+static inline int64_t crp_decompress(const void *asset, void *dst,
+                                     uint64_t capacity) {
+    const uint8_t *header = (const uint8_t *)asset;
+    const uint64_t size = crp_read64(header);
+    if (capacity < size) {
+        return -1;
+    }
+    int64_t decoded = crp_lz4_decode(header + CRP_COMPRESSED_HEADER_SIZE,
+                                     crp_read64(header + 8), (uint8_t *)dst,
+                                     size);
+    return decoded == (int64_t)size ? decoded : -1;
+}
+
+// Asset decompressed on first access, zero initialized:
+//   static crp_lazy config;
+//   const char *json = (const char *)crp_lazy_get(&config, config_json);
+typedef struct {
+    uint8_t *data;
+} crp_lazy;
+
+// Decompresses asset into a heap buffer on the first call and returns the
+// same buffer after, safe to call from several threads. Returns NULL if
+// allocation or decompression fails.
+static inline const uint8_t *crp_lazy_get(crp_lazy *lazy, const void *asset) {
+    uint8_t *data = __atomic_load_n(&lazy->data, __ATOMIC_ACQUIRE);
+    if (data) {
+        return data;
+    }
+    const uint64_t size = crp_decompressed_size(asset);
+    data = (uint8_t *)malloc(size ? size : 1);
+    if (!data || crp_decompress(asset, data, size) < 0) {
+        free(data);
+        return NULL;
+    }
+    uint8_t *expected = NULL;
+    if (!__atomic_compare_exchange_n(&lazy->data, &expected, data, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(data); // another thread was first
+        return expected;
+    }
+    return data;
+}
+
+// Asset directory (--directory): every asset by its path in config, looked
+// up through a minimal perfect hash built by crp, nothing is constructed at
+// startup.
+typedef struct {
+    const char *name; // path in config
+    const uint8_t *data;
+    uint64_t size; // value of the size variable
+} crp_entry;
+
+typedef struct {
+    uint64_t count;
+    uint64_t buckets_count;
+    uint64_t seed;
+    const crp_entry *entries;      // in hash slot order
+    const uint32_t *displacements; // per bucket
+} crp_directory_t;
+
+extern const crp_directory_t crp_directory;
+
+// displacement with this bit set is the slot itself
+#define CRP_DIRECT_SLOT 0x80000000u
+
+static inline uint64_t crp_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// FNV-1a of name, mixed, picks the bucket
+static inline uint64_t crp_hash(const char *name, uint64_t seed) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+    for (; *name; name++) {
+        h ^= (uint8_t)*name;
+        h *= 0x100000001b3ULL;
+    }
+    return crp_mix(h);
+}
+
+// slot of a name with hash h in a bucket with displacement d
+static inline uint64_t crp_slot(uint64_t h, uint32_t d, uint64_t count) {
+    if (d & CRP_DIRECT_SLOT) {
+        return d & ~CRP_DIRECT_SLOT;
+    }
+    return crp_mix(h + d * 0x9e3779b97f4a7c15ULL) % count;
+}
+
+// Entry of the asset listed in config as name, NULL if there is none.
+static inline const crp_entry *crp_find(const char *name) {
+    const crp_directory_t *dir = &crp_directory;
+    if (dir->count == 0) {
+        return NULL;
+    }
+    uint64_t h = crp_hash(name, dir->seed);
+    uint32_t d = dir->displacements[h % dir->buckets_count];
+    const crp_entry *entry = &dir->entries[crp_slot(h, d, dir->count)];
+    return strcmp(entry->name, name) == 0 ? entry : NULL;
+}
+
+// Pack assets ('p' in config) bundle every file under a directory into one
+// blob behind two symbols: the number of files, an index sorted by name
+// hash, names and contents. Names are paths relative to the directory with
+// '/' separators:
+//   extern const uint8_t icons[];
+//   uint64_t size;
+//   const uint8_t *png = crp_pack_find(icons, "ui/ok.png", &size);
+typedef struct {
+    uint64_t hash;   // crp_hash(name, 0)
+    uint64_t offset; // of the content from the start of the pack
+    uint64_t size;
+    uint64_t name; // offset of the zero terminated name
+} crp_pack_entry;
+
+static inline uint64_t crp_pack_count(const void *pack) {
+    return *(const uint64_t *)pack;
+}
+
+// in hash order, then name order
+static inline const crp_pack_entry *crp_pack_entries(const void *pack) {
+    return (const crp_pack_entry *)((const uint8_t *)pack + sizeof(uint64_t));
+}
+
+static inline const char *crp_pack_name(const void *pack,
+                                        const crp_pack_entry *entry) {
+    return (const char *)pack + entry->name;
+}
+
+static inline const uint8_t *crp_pack_data(const void *pack,
+                                           const crp_pack_entry *entry) {
+    return (const uint8_t *)pack + entry->offset;
+}
+
+// Content of the file at name in pack, its size in size if not NULL. NULL
+// if there is none.
+static inline const uint8_t *crp_pack_find(const void *pack, const char *name,
+                                           uint64_t *size) {
+    const crp_pack_entry *entries = crp_pack_entries(pack);
+    const uint64_t hash = crp_hash(name, 0);
+    uint64_t low = 0;
+    uint64_t high = crp_pack_count(pack);
+    while (low < high) {
+        const uint64_t mid = low + (high - low) / 2;
+        if (entries[mid].hash < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (; low < crp_pack_count(pack) && entries[low].hash == hash; low++) {
+        if (strcmp(crp_pack_name(pack, &entries[low]), name) == 0) {
+            if (size) {
+                *size = entries[low].size;
+            }
+            return crp_pack_data(pack, &entries[low]);
+        }
+    }
+    return NULL;
+}
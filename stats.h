@@ -0,0 +1,176 @@
+#pragma once
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// Measurements behind --stats, --stats-json and --trace. Phases of a run
+// follow each other on the main thread, stats_phase() ends the current one
+// and starts the next. Phases and I/O counters are always kept, they cost a
+// couple of clock reads per phase and a relaxed atomic add per syscall.
+// Time spent on every asset is kept only after stats_track_assets(), trace
+// events only when tracing.
+
+#define STATS_MAX_PHASES 32
+
+typedef struct {
+    const char *name;
+    uint64_t start_ns; // since stats_start()
+    uint64_t wall_ns;
+    uint64_t cpu_ns; // of all threads
+} StatsPhase;
+
+// Complete event of a thread: an asset processed by a task, or a phase.
+typedef struct {
+    const char *name;
+    uint32_t asset; // UINT32_MAX for phases
+    uint32_t thread;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+} StatsEvent;
+
+typedef struct {
+    uint64_t start_ns;
+    StatsPhase phases[STATS_MAX_PHASES];
+    uint32_t phases_count;
+    bool open; // last phase is running
+
+    _Atomic uint64_t bytes_read;
+    _Atomic uint64_t bytes_written;
+    _Atomic uint64_t syscalls;
+
+    _Atomic uint64_t *asset_ns; // per asset, NULL unless tracked
+    uint32_t assets_count;
+
+    bool trace;
+    pthread_mutex_t events_lock;
+    StatsEvent *events;
+    uint64_t events_count;
+    uint64_t events_capacity;
+    _Atomic uint32_t threads_count;
+} Stats;
+
+Stats stats = {.events_lock = PTHREAD_MUTEX_INITIALIZER};
+
+uint64_t stats_clock(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t stats_now(void) {
+    return stats_clock(CLOCK_MONOTONIC) - stats.start_ns;
+}
+
+// Small number of the calling thread, in order of first use.
+uint32_t stats_thread(void) {
+    static _Thread_local uint32_t thread = UINT32_MAX;
+    if (thread == UINT32_MAX) {
+        thread = atomic_fetch_add(&stats.threads_count, 1);
+    }
+    return thread;
+}
+
+// Times are from here on, the calling thread is 0 in the trace.
+void stats_start(bool trace) {
+    stats.start_ns = stats_clock(CLOCK_MONOTONIC);
+    stats.trace = trace;
+    stats_thread();
+}
+
+// Per asset times for assets_count assets, from here on.
+void stats_track_assets(uint32_t assets_count) {
+    stats.asset_ns = calloc(assets_count ? assets_count : 1,
+                            sizeof(*stats.asset_ns));
+    stats.assets_count = assets_count;
+}
+
+void stats_event(const char *name, uint32_t asset, uint64_t start_ns,
+                 uint64_t end_ns) {
+    StatsEvent event = {
+        .name = name,
+        .asset = asset,
+        .thread = stats_thread(),
+        .start_ns = start_ns,
+        .duration_ns = end_ns - start_ns,
+    };
+    pthread_mutex_lock(&stats.events_lock);
+    if (stats.events_count == stats.events_capacity) {
+        stats.events_capacity =
+            stats.events_capacity ? stats.events_capacity * 2 : 256;
+        stats.events = realloc(stats.events,
+                               stats.events_capacity * sizeof(StatsEvent));
+    }
+    stats.events[stats.events_count++] = event;
+    pthread_mutex_unlock(&stats.events_lock);
+}
+
+// Ends the running phase and starts one called name, unless it's NULL.
+void stats_phase(const char *name) {
+    const uint64_t now = stats_now();
+    const uint64_t cpu = stats_clock(CLOCK_PROCESS_CPUTIME_ID);
+    if (stats.open) {
+        StatsPhase *phase = &stats.phases[stats.phases_count - 1];
+        phase->wall_ns = now - phase->start_ns;
+        phase->cpu_ns = cpu - phase->cpu_ns;
+        if (stats.trace) {
+            stats_event(phase->name, UINT32_MAX, phase->start_ns, now);
+        }
+    }
+    stats.open = name && stats.phases_count < STATS_MAX_PHASES;
+    if (stats.open) {
+        stats.phases[stats.phases_count++] = (StatsPhase){
+            .name = name,
+            .start_ns = now,
+            .cpu_ns = cpu, // at start until the phase ends
+        };
+    }
+}
+
+// Adds time since start_ns, from stats_now(), to asset. name is what was
+// done to it, shown in the trace.
+void stats_asset(const char *name, uint32_t asset, uint64_t start_ns) {
+    if (!stats.asset_ns || asset >= stats.assets_count) {
+        return;
+    }
+    const uint64_t end = stats_now();
+    atomic_fetch_add_explicit(&stats.asset_ns[asset], end - start_ns,
+                              memory_order_relaxed);
+    if (stats.trace) {
+        stats_event(name, asset, start_ns, end);
+    }
+}
+
+// Counts a syscall that read or wrote bytes, 0 and 0 for others. Callers
+// count opens, stats, reads, writes and copies by hand, closes, mmaps and
+// the like aren't, so the count is approximate.
+void stats_io(uint64_t read, uint64_t written) {
+    atomic_fetch_add_explicit(&stats.syscalls, 1, memory_order_relaxed);
+    if (read) {
+        atomic_fetch_add_explicit(&stats.bytes_read, read,
+                                  memory_order_relaxed);
+    }
+    if (written) {
+        atomic_fetch_add_explicit(&stats.bytes_written, written,
+                                  memory_order_relaxed);
+    }
+}
+
+// Bytes put into a mapped output, no syscall involved.
+void stats_mapped_write(uint64_t written) {
+    atomic_fetch_add_explicit(&stats.bytes_written, written,
+                              memory_order_relaxed);
+}
+
+uint64_t stats_peak_rss_kib(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // bytes there
+#else
+    return usage.ru_maxrss;
+#endif
+}
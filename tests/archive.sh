@@ -0,0 +1,69 @@
+# Checks that a program linked with an archive output ('.a') pulls only the
+# members of assets it references, and that crp_find() of runtime/crp.h
+# finds assets of --directory by their path in config.
+cd "$(dirname "$0")"
+dir=build/archive
+rm -rf $dir
+mkdir -p $dir
+${CC:-cc} -w -pthread ../crp.c -o build/crp || exit 1
+
+printf 'used' > $dir/used.txt
+printf 'dropped' > $dir/unused.txt
+printf '{"ui":1}' > $dir/main.json
+cat > $dir/crp.conf << EOF
+$dir/used.txt s used
+$dir/unused.txt s unused
+EOF
+cat > $dir/main.c << EOF
+#include <stdio.h>
+extern const char used[];
+int main(void) {
+    printf("%s\n", used);
+    return 0;
+}
+EOF
+
+failed=0
+if ./build/crp -q -c $dir/crp.conf $dir/assets.a &&
+    ${CC:-cc} $dir/main.c $dir/assets.a -o $dir/main; then
+    [ "$(./$dir/main)" = used ] || {
+        echo "archive: got '$(./$dir/main)'"
+        failed=1
+    }
+    if nm $dir/main | grep -q ' unused$'; then
+        echo "archive: unreferenced member was linked"
+        failed=1
+    fi
+else
+    failed=1
+fi
+
+cat > $dir/directory.conf << EOF
+$dir/main.json b
+$dir/used.txt s
+EOF
+cat > $dir/find.c << EOF
+#include "crp.h"
+#include <stdio.h>
+int main(void) {
+    const crp_entry *json = crp_find("$dir/main.json");
+    const crp_entry *text = crp_find("$dir/used.txt");
+    printf("%.*s %s %llu %s\n", (int)json->size, (const char *)json->data,
+           (const char *)text->data, (unsigned long long)text->size,
+           crp_find("main.json") ? "found" : "missing");
+    return 0;
+}
+EOF
+if ./build/crp -q --directory -c $dir/directory.conf $dir/directory.o &&
+    ${CC:-cc} -I../runtime $dir/find.c $dir/directory.o -o $dir/find; then
+    output=$(./$dir/find)
+    if [ "$output" != '{"ui":1} used 5 missing' ]; then
+        echo "directory: got '$output'"
+        failed=1
+    fi
+else
+    failed=1
+fi
+
+rm -rf $dir
+[ "$failed" -eq 0 ] && echo "archive ok"
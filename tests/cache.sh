@@ -0,0 +1,82 @@
+# Checks that --cache leaves an up to date output untouched, and rebuilds it
+# when an asset's bytes, the config, a directory listed by a pattern or an
+# option changes.
+cd "$(dirname "$0")"
+dir=build/cache
+rm -rf $dir
+mkdir -p $dir/assets
+${CC:-cc} -w -pthread ../crp.c -o build/crp || exit 1
+
+printf 'first' > $dir/value.txt
+printf 'a' > $dir/assets/a.txt
+cat > $dir/crp.conf << EOF
+$dir/value.txt s value
+$dir/assets/ sg
+EOF
+cat > $dir/main.c << EOF
+#include <stdio.h>
+extern const char value[];
+int main(void) {
+    printf("%s\n", value);
+    return 0;
+}
+EOF
+
+failed=0
+# run name expected [options]: expected is "built" or "up to date"
+run() {
+    name=$1
+    expected=$2
+    shift 2
+    if ! ./build/crp --cache "$@" -c $dir/crp.conf $dir/assets.o \
+        > $dir/stdout; then
+        echo "$name: crp failed"
+        failed=1
+        return
+    fi
+    result=built
+    grep -q 'is up to date' $dir/stdout && result="up to date"
+    if [ "$result" != "$expected" ]; then
+        echo "$name: expected $expected, was $result"
+        failed=1
+    fi
+}
+
+# changed bytes of the same size, mtime moved on in case it's coarse
+modify() {
+    printf '%s' "$2" > "$1"
+    touch -d "@$(($(date +%s) + $3))" "$1"
+}
+
+run first built
+run unchanged "up to date"
+mtime=$(stat -c %y $dir/assets.o)
+run "unchanged again" "up to date"
+if [ "$(stat -c %y $dir/assets.o)" != "$mtime" ]; then
+    echo "up to date output was touched"
+    failed=1
+fi
+
+modify $dir/value.txt 'other' 10
+run "asset bytes" built
+${CC:-cc} $dir/main.c $dir/assets.o -o $dir/main &&
+    [ "$(./$dir/main)" = other ] || {
+    echo "asset bytes: output has the old content"
+    failed=1
+}
+run "after asset bytes" "up to date"
+
+echo "$dir/value.txt s value 16" > $dir/crp.conf.new
+echo "$dir/assets/ sg" >> $dir/crp.conf.new
+mv $dir/crp.conf.new $dir/crp.conf
+run config built
+
+printf 'b' > $dir/assets/b.txt
+touch -d "@$(($(date +%s) + 20))" $dir/assets
+run "new file in a pattern" built
+
+run option built --page-align
+run "same option" "up to date" --page-align
+
+rm -rf $dir
+[ "$failed" -eq 0 ] && echo "cache ok"
@@ -0,0 +1,50 @@
+# Checks that assets with the same bytes share them, hard links included,
+# that assets of the same size with different bytes don't, and that a string
+# which is the tail of another one points into it.
+cd "$(dirname "$0")"
+dir=build/dedup
+rm -rf $dir
+mkdir -p $dir
+${CC:-cc} -w -pthread ../crp.c -o build/crp || exit 1
+
+printf 'same bytes' > $dir/a.bin
+printf 'same bytes' > $dir/b.bin
+printf 'same bytez' > $dir/c.bin
+ln $dir/a.bin $dir/d.bin
+printf 'hello world' > $dir/hello.txt
+printf 'world' > $dir/world.txt
+cat > $dir/crp.conf << EOF
+$dir/a.bin b a
+$dir/b.bin b b
+$dir/c.bin b c
+$dir/d.bin b d
+$dir/hello.txt s hello
+$dir/world.txt s world
+EOF
+cat > $dir/main.c << EOF
+#include <stdio.h>
+extern const char a[], b[], c[], d[], hello[], world[];
+int main(void) {
+    printf("%s %s %s %.10s %s\n", a == b ? "shared" : "apart",
+           a == d ? "shared" : "apart", a == c ? "shared" : "apart", c,
+           world == hello + 6 ? "tail" : "apart");
+    return 0;
+}
+EOF
+
+failed=0
+for jobs in 1 4; do
+    if ./build/crp -q -j $jobs -c $dir/crp.conf $dir/assets.o &&
+        ${CC:-cc} $dir/main.c $dir/assets.o -o $dir/main; then
+        output=$(./$dir/main)
+        if [ "$output" != "shared shared apart same bytez tail" ]; then
+            echo "-j $jobs: got '$output'"
+            failed=1
+        fi
+    else
+        failed=1
+    fi
+done
+
+rm -rf $dir
+[ "$failed" -eq 0 ] && echo "dedup ok"
@@ -0,0 +1,44 @@
+# Embeds FILES sparse assets of FILE_SIZE each and checks that peak RSS of crp
+# stays within --max-memory plus a fixed allowance for metadata. Every asset
+# holds its number at the start and in the middle, so dedup can't merge them
+# and all of them are copied.
+cd "$(dirname "$0")"
+FILES=${FILES:-10000}
+FILE_SIZE=${FILE_SIZE:-300K}
+MAX_MEMORY_MB=${MAX_MEMORY_MB:-16}
+ALLOWANCE_MB=${ALLOWANCE_MB:-32}
+
+mkdir -p build/max_memory/assets
+${CC:-cc} -w -pthread ../crp.c -o build/crp || exit 1
+
+file_bytes=$(numfmt --from=iec "$FILE_SIZE")
+half_size=$((file_bytes / 2))
+: > build/max_memory/crp.conf
+for i in $(seq 1 "$FILES"); do
+    file=build/max_memory/assets/$i.bin
+    printf '%s\n' "$i" > "$file"
+    truncate -s "$half_size" "$file"
+    printf '%s\n' "$i" >> "$file"
+    truncate -s "$FILE_SIZE" "$file"
+    echo "build/max_memory/assets/$i.bin b asset_$i" >> build/max_memory/crp.conf
+done
+
+./build/crp -q -c build/max_memory/crp.conf --max-memory ${MAX_MEMORY_MB}M \
+    build/max_memory/assets.o &
+pid=$!
+peak_kb=0
+while kill -0 $pid 2> /dev/null; do
+    hwm=$(awk '/VmHWM/ { print $2 }' /proc/$pid/status 2> /dev/null)
+    if [ -n "$hwm" ] && [ "$hwm" -gt "$peak_kb" ]; then
+        peak_kb=$hwm
+    fi
+    sleep 0.05
+done
+wait $pid || exit 1
+
+output_size=$(stat -c %s build/max_memory/assets.o)
+rm -rf build/max_memory
+
+limit_kb=$(((MAX_MEMORY_MB + ALLOWANCE_MB) * 1024))
+echo "output: $output_size bytes, peak rss: $peak_kb KiB, limit: $limit_kb KiB"
+[ "$output_size" -ge $((FILES * file_bytes)) ] && [ "$peak_kb" -le "$limit_kb" ]
@@ -0,0 +1,63 @@
+# Checks that crp_pack_find() of runtime/crp.h finds every file of a pack
+# ('p') by its path in the directory, empty ones included, and nothing else,
+# that a symlink looping back to a parent directory isn't followed and that
+# two packs of the same files share their bytes.
+cd "$(dirname "$0")"
+dir=build/packs
+rm -rf $dir
+mkdir -p $dir/icons/ui/small
+${CC:-cc} -w -pthread ../crp.c -o build/crp || exit 1
+
+printf 'ok png' > $dir/icons/ui/ok.png
+printf 'tiny' > $dir/icons/ui/small/x.png
+printf 'top level' > $dir/icons/readme.txt
+: > $dir/icons/empty
+ln -s .. $dir/icons/ui/loop
+cp -r $dir/icons $dir/copy
+cat > $dir/crp.conf << EOF
+$dir/icons p icons
+$dir/copy p copy
+EOF
+cat > $dir/main.c << EOF
+#include "crp.h"
+#include <stdio.h>
+extern const uint8_t icons[], copy[];
+static void find(const char *name) {
+    uint64_t size = 0;
+    const uint8_t *data = crp_pack_find(icons, name, &size);
+    if (data) {
+        printf("%s=%.*s;", name, (int)size, (const char *)data);
+    } else {
+        printf("%s missing;", name);
+    }
+}
+int main(void) {
+    printf("%llu;", (unsigned long long)crp_pack_count(icons));
+    find("ui/ok.png");
+    find("ui/small/x.png");
+    find("readme.txt");
+    find("empty");
+    find("ui/loop/readme.txt");
+    find("ok.png");
+    printf("%s\n", icons == copy ? "shared" : "apart");
+    return 0;
+}
+EOF
+
+failed=0
+if ./build/crp -q -c $dir/crp.conf $dir/assets.o &&
+    ${CC:-cc} -I../runtime $dir/main.c $dir/assets.o -o $dir/main; then
+    expected="4;ui/ok.png=ok png;ui/small/x.png=tiny;readme.txt=top level;"
+    expected="${expected}empty=;ui/loop/readme.txt missing;ok.png missing;"
+    expected="${expected}shared"
+    output=$(./$dir/main)
+    if [ "$output" != "$expected" ]; then
+        echo "expected '$expected', got '$output'"
+        failed=1
+    fi
+else
+    failed=1
+fi
+
+rm -rf $dir
+[ "$failed" -eq 0 ] && echo "packs ok"
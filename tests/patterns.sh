@@ -0,0 +1,61 @@
+# Checks that patterns ('g') embed every matching file under a name made of
+# its path, that names colliding anyway are an error and that a symlink
+# looping back to a parent directory isn't followed.
+cd "$(dirname "$0")"
+dir=build/patterns
+rm -rf $dir
+mkdir -p $dir/assets/ui $dir/assets/sub
+${CC:-cc} -w -pthread ../crp.c -o build/crp || exit 1
+
+failed=0
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "$1: expected '$3', got '$2'"
+        failed=1
+    fi
+}
+
+printf 'main' > $dir/assets/ui/main.json
+printf 'top' > $dir/assets/top.json
+printf 'skipped' > $dir/assets/.hidden.json
+ln -s .. $dir/assets/sub/loop
+cat > $dir/crp.conf << EOF
+$dir/assets/**/*.json sg
+EOF
+cat > $dir/main.c << EOF
+#include <stdint.h>
+#include <stdio.h>
+extern const char assets_ui_main_json[], assets_top_json[];
+extern const uint64_t assets_ui_main_json_len, assets_top_json_len;
+int main(void) {
+    printf("%s %llu %s %llu\n", assets_ui_main_json,
+           (unsigned long long)assets_ui_main_json_len, assets_top_json,
+           (unsigned long long)assets_top_json_len);
+    return 0;
+}
+EOF
+if ./build/crp -q -c $dir/crp.conf $dir/assets.o &&
+    ${CC:-cc} $dir/main.c $dir/assets.o -o $dir/main; then
+    check round-trip "$(./$dir/main)" "main 5 top 4"
+    check hidden "$(nm $dir/assets.o | grep -c hidden)" 0
+else
+    echo "pattern with a symlink loop failed"
+    failed=1
+fi
+
+# both are named collide_b_c_txt
+mkdir -p $dir/collide/b
+printf '1' > $dir/collide/b_c.txt
+printf '2' > $dir/collide/b/c.txt
+cat > $dir/collide.conf << EOF
+$dir/collide/**/*.txt sg
+EOF
+if ./build/crp -q -c $dir/collide.conf $dir/collide.o 2> $dir/error; then
+    echo "colliding names weren't an error"
+    failed=1
+fi
+check collision "$(cat $dir/error)" \
+    "$dir/collide/b/c.txt and $dir/collide/b_c.txt are both named collide_b_c_txt"
+
+rm -rf $dir
+[ "$failed" -eq 0 ] && echo "patterns ok"
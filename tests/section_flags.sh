@@ -0,0 +1,62 @@
+# Checks that assets land in a read-only section and only assets marked 'w'
+# in a writable one, and that a 2M aligned section is aligned in addresses
+# without padding the file. ELF objects are inspected with readelf, Mach-O
+# ones with otool when it's available.
+cd "$(dirname "$0")"
+mkdir -p build/section_flags
+${CC:-cc} -w -pthread ../crp.c -o build/crp || exit 1
+
+printf 'constant' > build/section_flags/const.txt
+printf 'patched' > build/section_flags/patched.txt
+printf 'huge page' > build/section_flags/huge.bin
+cat > build/section_flags/crp.conf << EOF
+build/section_flags/const.txt s const_txt
+build/section_flags/patched.txt sw patched_txt
+build/section_flags/huge.bin bw huge_bin 2M
+EOF
+
+failed=0
+check() {
+    if ! echo "$2" | grep -Eq "$3"; then
+        echo "$1: expected $3 in:"
+        echo "$2"
+        failed=1
+    fi
+}
+
+# sections are placed in the file at 64K at most
+check_size() {
+    size=$(wc -c < "$2")
+    if [ "$size" -ge 1048576 ]; then
+        echo "$1: $size bytes, 2M alignment padded the file"
+        failed=1
+    fi
+}
+
+if command -v readelf > /dev/null; then
+    ./build/crp -q -c build/section_flags/crp.conf --target elf-x86_64 \
+        build/section_flags/assets.o || exit 1
+    sections=$(readelf -SW build/section_flags/assets.o)
+    symbols=$(readelf -sW build/section_flags/assets.o)
+    # flags column: A is alloc, W is write
+    check elf "$sections" '\.rodata +PROGBITS +[0-9a-f]+ [0-9a-f]+ [0-9a-f]+ 00 +A '
+    check elf "$sections" '\.data +PROGBITS +[0-9a-f]+ [0-9a-f]+ [0-9a-f]+ 00 +WA '
+    check elf "$symbols" ' 1 const_txt$'
+    check elf "$symbols" ' 2 patched_txt$'
+    check elf "$sections" '\.data +PROGBITS .* 2097152$'
+    check_size elf build/section_flags/assets.o
+fi
+
+if command -v otool > /dev/null; then
+    ./build/crp -q -c build/section_flags/crp.conf --target macho-arm64 \
+        build/section_flags/assets.o || exit 1
+    commands=$(otool -l build/section_flags/assets.o)
+    check macho "$commands" 'sectname __const'
+    check macho "$commands" 'sectname __data'
+    check macho "$commands" 'maxprot 0x00000003'
+    check macho "$commands" 'align 2\^21'
+    check_size macho build/section_flags/assets.o
+fi
+
+rm -rf build/section_flags
+[ "$failed" -eq 0 ] && echo "section flags ok"